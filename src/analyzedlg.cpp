@@ -151,7 +151,11 @@ AnalyzeDialog::job::job (AnalyzeDialog *dlg, const QString &title, go_game_ptr g
 	: m_dlg (dlg), m_title (title), m_game (gr), m_n_seconds (n_seconds), m_n_lines (n_lines), m_komi_type (k),
 	  m_comments (comments), m_rules (rules)
 {
-	std::vector<game_state *> *q = &m_queue;
+	/* Positions reached again through a different move order look up the evaluation
+	   of the first occurrence, so only that one needs to be analyzed.  */
+	m_game->find_transpositions ();
+
+	std::vector<node_ref> *q = &m_queue;
 	std::function<bool (game_state *)> f = [&q] (game_state *st) -> bool
 		{
 			eval ev = st->best_eval ();
@@ -159,9 +163,9 @@ AnalyzeDialog::job::job (AnalyzeDialog *dlg, const QString &title, go_game_ptr g
 				return false;
 			/* Ignore score and pass nodes on the grounds that they should be identical to the
 			   preceding one.  */
-			if (st->was_score_p () || st->was_pass_p ())
+			if (st->was_score_p () || st->was_pass_p () || st->transposition_p ())
 				return true;
-			q->push_back (st);
+			q->push_back (st->ref ());
 			return true;
 		};
 	/* This produces the nodes in the reverse order of the game.  We rely on this
@@ -180,26 +184,32 @@ AnalyzeDialog::job::~job ()
 		disconnect (m_connection);
 }
 
+/* Return the next position to analyze.  When just looking (POP false), positions
+   that were deleted since the job was queued are dropped.  When popping the one
+   that was sent to the engine, the result is null if it was deleted meanwhile.  */
 game_state *AnalyzeDialog::job::select_request (bool pop)
 {
 	if (m_queue_flipped.size () > 0 && m_dlg->m_current_komi.isEmpty ()) {
 		m_initial_size -= m_queue_flipped.size ();
 		m_queue_flipped.clear ();
 	}
-	if (m_queue.size () == 0) {
-		m_komi_type = engine_komi::do_swap;
-		if (m_queue_flipped.size () == 0)
-			return nullptr;
-		game_state *st = m_queue_flipped.back ();
-		if (pop)
-			m_queue_flipped.pop_back ();
-		return st;
+	for (;;) {
+		std::vector<node_ref> *q = &m_queue;
+		if (q->size () == 0) {
+			m_komi_type = engine_komi::do_swap;
+			q = &m_queue_flipped;
+			if (q->size () == 0)
+				return nullptr;
+		}
+		game_state *st = m_game->resolve (q->back ());
+		if (pop || st != nullptr) {
+			if (pop)
+				q->pop_back ();
+			return st;
+		}
+		q->pop_back ();
+		m_initial_size--;
 	}
-
-	game_state *st = m_queue.back ();
-	if (pop)
-		m_queue.pop_back ();
-	return st;
 }
 
 void AnalyzeDialog::job::show_window (bool done)
@@ -316,11 +326,26 @@ void AnalyzeDialog::enqueue_dir ()
 	QStringList filters;
 	filters << "*.sgf" << "*.SGF";
 	dir.setNameFilters (filters);
-	int skipped = 0;
-	int failed = 0;
-	for (auto f: dir.entryList (QDir::Files | QDir::Readable | QDir::NoDotAndDotDot, QDir::Name)) {
-		start_job (dir.absoluteFilePath (f));
-	}
+	int boardsize = ui->boardsizeSpinBox->value ();
+	QStringList files;
+	for (auto f: dir.entryList (QDir::Files | QDir::Readable | QDir::NoDotAndDotDot, QDir::Name))
+		files << dir.absoluteFilePath (f);
+	/* Loading is done in the background, so that large directories do not
+	   freeze the GUI.  The board size is checked there as well, from the root
+	   node, so that games which can't be analyzed are not converted.  */
+	QString mismatch = tr ("board size does not match");
+	records_from_files (this, files, nullptr,
+			    [this] (const QString &f, go_game_ptr gr)
+			    {
+				    start_job (f, gr);
+			    },
+			    [boardsize, mismatch] (const sgf &s) -> QString
+			    {
+				    std::pair<int, int> sz = sizes_from_sgfroot (s);
+				    if (sz.first != sz.second || sz.first != boardsize)
+					    return mismatch;
+				    return QString ();
+			    });
 }
 
 void AnalyzeDialog::select_file_db ()
@@ -395,6 +420,11 @@ void AnalyzeDialog::eval_received (const analyzer_id &id, const QString &, int,
 	update_progress ();
 
 	game_state *st = j->select_request (true);
+	if (st == nullptr) {
+		/* Deleted by the user while the engine was looking at it.  */
+		finish_request (j);
+		return;
+	}
 	st->update_eval (*m_eval_state);
 	auto variations = m_eval_state->take_children ();
 	if (j->m_comments && variations.size () > 0) {
@@ -476,7 +506,13 @@ void AnalyzeDialog::eval_received (const analyzer_id &id, const QString &, int,
 		if (count >= j->m_n_lines)
 			break;
 	}
+	finish_request (j);
+}
 
+/* Called after a result for job J was received.  Move it to the list of completed
+   jobs if that was the last position, and send the next request.  */
+void AnalyzeDialog::finish_request (job *j)
+{
 	if (j->select_request (false) == nullptr) {
 		if (j->m_win != nullptr)
 			j->m_win->setGameMode (modeNormal);
@@ -605,7 +641,11 @@ void AnalyzeDialog::start_job (const QString &f)
 	go_game_ptr gr = record_from_file (f, nullptr);
 	if (gr == nullptr)
 		return;
+	start_job (f, gr);
+}
 
+void AnalyzeDialog::start_job (const QString &f, go_game_ptr gr)
+{
 	QFileInfo fi (f);
 	m_last_dir = fi.dir ().absolutePath ();
 
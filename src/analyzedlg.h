@@ -68,8 +68,10 @@ class AnalyzeDialog : public QMainWindow, public GTP_Eval_Controller
 		bool m_comments;
 		go_rules m_rules;
 
-		std::vector<game_state *> m_queue;
-		std::vector<game_state *> m_queue_flipped;
+		/* References rather than pointers, since the user can delete positions in
+		   the job's window while it runs.  */
+		std::vector<node_ref> m_queue;
+		std::vector<node_ref> m_queue_flipped;
 		size_t m_initial_size;
 		size_t m_done = 0;
 
@@ -91,6 +93,7 @@ class AnalyzeDialog : public QMainWindow, public GTP_Eval_Controller
 	QString m_last_dir;
 
 	void queue_next ();
+	void finish_request (job *);
 
 	void select_file ();
 	void select_file_db ();
@@ -99,6 +102,7 @@ class AnalyzeDialog : public QMainWindow, public GTP_Eval_Controller
 	void stop_engine ();
 	void start_job ();
 	void start_job (const QString &);
+	void start_job (const QString &, go_game_ptr);
 
 	/* Maintaining the job queue listviews and assorted data structures.  */
 	void insert_job (display &, QListView *, job *);
@@ -22,6 +22,8 @@ class bit_array
 	int m_n_elts;
 	uint64_t *m_bits;
 	uint64_t m_last_mask;
+	/* False for arrays that refer to memory owned by someone else.  */
+	bool m_owned = true;
 
 	void calc_mask (unsigned sz)
 	{
@@ -40,13 +42,22 @@ public:
 			m_bits[m_n_elts - 1] &= m_last_mask;
 		}
 	}
+	/* Refer to SZ bits stored at BITS, such as in a mapped file, without
+	   copying them.  The memory must outlive the array, and the array must
+	   not be modified.  */
+	bit_array (const uint64_t *bits, unsigned sz)
+		: m_n_bits (sz), m_n_elts ((sz + 63) / 64), m_bits (const_cast<uint64_t *> (bits)), m_owned (false)
+	{
+		calc_mask (sz);
+	}
 	bit_array (const bit_array &other)
 		: m_n_bits (other.m_n_bits), m_n_elts (other.m_n_elts), m_bits (new uint64_t[m_n_elts]), m_last_mask (other.m_last_mask)
 	{
 		memcpy (m_bits, other.m_bits, m_n_elts * sizeof (uint64_t));
 	}
 	bit_array (bit_array &&other) noexcept
-		: m_n_bits (other.m_n_bits), m_n_elts (other.m_n_elts), m_bits (other.m_bits), m_last_mask (other.m_last_mask)
+		: m_n_bits (other.m_n_bits), m_n_elts (other.m_n_elts), m_bits (other.m_bits), m_last_mask (other.m_last_mask),
+		  m_owned (other.m_owned)
 	{
 		if (&other == this)
 			return;
@@ -56,7 +67,8 @@ public:
 	}
 	~bit_array ()
 	{
-		delete[] m_bits;
+		if (m_owned)
+			delete[] m_bits;
 	}
 	bit_array &operator= (bit_array other)
 	{
@@ -64,6 +76,7 @@ public:
 		std::swap (m_n_bits, other.m_n_bits);
 		std::swap (m_bits, other.m_bits);
 		std::swap (m_last_mask, other.m_last_mask);
+		std::swap (m_owned, other.m_owned);
 		return *this;
 	}
 	bool operator== (const bit_array &other) const
@@ -92,7 +105,9 @@ public:
 		m_n_bits = sz;
 		m_n_elts = new_nelts;
 		std::swap (m_bits, new_bits);
-		delete[] new_bits;
+		if (m_owned)
+			delete[] new_bits;
+		m_owned = true;
 	}
 	void debug () const;
 	void debug (int linesz) const;
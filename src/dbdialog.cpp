@@ -1,5 +1,8 @@
 #include <QPushButton>
 #include <QFileDialog>
+#include <QInputDialog>
+#include <QMessageBox>
+#include <QApplication>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 
@@ -63,6 +66,7 @@ DBDialog::DBDialog (QWidget *parent)
 		 [this] (bool) { ui->boardView->set_displayed (ui->boardView->displayed ()->prev_move ()); update_buttons (); });
 
 	connect (ui->dbConfButton, &QPushButton::clicked, [] (bool) { client_window->dlgSetPreferences (6); });
+	connect (ui->openingTreeButton, &QPushButton::clicked, this, &DBDialog::build_opening_tree);
 }
 
 DBDialog::~DBDialog ()
@@ -118,21 +122,24 @@ void DBDialog::clear_preview ()
 	ui->goPrevButton->setEnabled (false);
 }
 
-bool DBDialog::setPath (QString path)
+bool DBDialog::setPath (QString path, size_t game)
 {
 	clear_preview ();
 
 	try {
 		QFile f (path);
 		f.open (QIODevice::ReadOnly);
-		// IOStreamAdapter adapter (&f);
-		sgf *sgf = load_sgf (f);
+		IODeviceAdapter in (f);
+		size_t n_games = 0;
+		sgf *sgf = load_sgf_game (path, in, game, &n_games);
 		if (ui->overwriteSGFEncoding->isChecked ()) {
 			m_game = sgf2record (*sgf, QTextCodec::codecForName (ui->encodingList->currentText ().toLatin1 ()));
 		} else {
 			m_game = sgf2record (*sgf, nullptr);
 		}
-		m_game->set_filename (path.toStdString ());
+		/* Only a file holding just this game can be overwritten with it.  */
+		if (n_games == 1)
+			m_game->set_filename (path.toStdString ());
 
 		ui->boardView->reset_game (m_game);
 		game_state *st = m_game->get_root ();
@@ -175,13 +182,36 @@ bool DBDialog::update_selection ()
 
 	QModelIndex i = selected.first ();
 	const gamedb_entry &e = m_model.find (i.row ());
-	QDir d (e.dirname);
-	QString filename = d.filePath (e.filename);
+	QDir d (db_data->str (e.dirname));
+	QString filename = d.filePath (db_data->str (e.filename));
 	qDebug () << filename;
-	setPath (filename);
+	setPath (filename, e.game_idx);
 	return true;
 }
 
+void DBDialog::build_opening_tree (bool)
+{
+	bool ok;
+	int n_moves = QInputDialog::getInt (this, tr ("Opening tree"), tr ("Number of moves to include:"),
+					    20, 1, 100, 1, &ok);
+	if (!ok)
+		return;
+	int min_games = QInputDialog::getInt (this, tr ("Opening tree"), tr ("Minimum number of games per variation:"),
+					      2, 1, 1000000, 1, &ok);
+	if (!ok)
+		return;
+
+	QApplication::setOverrideCursor (Qt::WaitCursor);
+	go_game_ptr gr = ::build_opening_tree (m_model.entries (), n_moves, min_games);
+	QApplication::restoreOverrideCursor ();
+	if (gr == nullptr) {
+		QMessageBox::warning (this, PACKAGE, tr ("No suitable games found in the list."));
+		return;
+	}
+	m_game = gr;
+	QDialog::accept ();
+}
+
 void DBDialog::handle_doubleclick ()
 {
 	if (!update_selection ())
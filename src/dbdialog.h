@@ -24,11 +24,12 @@ class DBDialog : public QDialog
 
 	gamedb_model m_model;
 
-	bool setPath (QString path);
+	bool setPath (QString path, size_t game);
 	void clear_preview ();
 	bool update_selection ();
 	void handle_doubleclick ();
 	void update_buttons ();
+	void build_opening_tree (bool);
 
 public slots:
 	void clear_filters (bool);
@@ -177,7 +177,8 @@ void EvalGraph::update (go_game_ptr gr, game_state *active, int sel_idx)
 		if (m_show_scores && idnr != sel_idx)
 			continue;
 		auto e = m_model->entries ()[idnr];
-		auto id = e.first;
+		/* Look up the analyzer once, so the per-node searches below compare indices.  */
+		int an_idx = r->analyzer_index (e.first);
 		QPainterPath path;
 		bool on_path = false;
 		double score_max = 15;
@@ -185,7 +186,7 @@ void EvalGraph::update (go_game_ptr gr, game_state *active, int sel_idx)
 		if (m_show_scores) {
 			for (game_state *s = r; s != nullptr; s = s->next_primary_move ()) {
 				eval ev;
-				if (s->find_eval (id, ev))
+				if (s->find_eval (an_idx, ev))
 					score_max = std::max (score_max, fabs (ev.score_mean));
 			}
 			if (score_max == 0)
@@ -218,7 +219,7 @@ void EvalGraph::update (go_game_ptr gr, game_state *active, int sel_idx)
 		QBrush sdbrush (v.value<QColor> ().lighter ());
 		for (int x = 0; st != nullptr; x++, st = st->next_primary_move ()) {
 			eval ev;
-			if (!st->find_eval (id, ev)) {
+			if (!st->find_eval (an_idx, ev)) {
 				on_path = false;
 				continue;
 			}
@@ -2,14 +2,25 @@
 #include <QSqlQuery>
 #include <QThread>
 #include <QDir>
+#include <QFileInfo>
+#include <QDateTime>
 #include <QMessageBox>
 #include <QRegularExpression>
 #include <QDebug>
 #include <QProgressDialog>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QCoreApplication>
+#include <QElapsedTimer>
 
 #include <memory>
 #include <algorithm>
+#include <atomic>
 #include <unordered_map>
+#include <map>
+#include <functional>
+#include <iterator>
+#include <numeric>
 
 #include "config.h"
 #include "gogame.h"
@@ -69,6 +80,36 @@ namespace date_re
 
 		return "0000" "-??" "-??";
 	}
+
+	/* Larger than the key of any date.  */
+	const unsigned max_key = 99999999;
+
+	/* Pack a date as returned by convert into an integer that sorts the same
+	   way, with unknown months and days counting as zero.  */
+	unsigned key (const QString &dt)
+	{
+		return dt.mid (0, 4).toUInt () * 10000 + dt.mid (5, 2).toUInt () * 100 + dt.mid (8, 2).toUInt ();
+	}
+
+	/* Return the first key (or the last, if LAST) of the dates matched by
+	   DT_IN, which was typed into a filter.  Without a year, the filter
+	   does not restrict anything.  */
+	unsigned bound (const QString &dt_in, bool last)
+	{
+		if (!year_re.match (dt_in).hasMatch ())
+			return last ? max_key : 0;
+		QString dt = convert (dt_in);
+		unsigned y = dt.mid (0, 4).toUInt ();
+		unsigned m = dt.mid (5, 2).toUInt ();
+		unsigned d = dt.mid (8, 2).toUInt ();
+		if (last) {
+			if (m == 0)
+				m = 99;
+			if (d == 0)
+				d = 99;
+		}
+		return y * 10000 + m * 100 + d;
+	}
 };
 
 
@@ -138,6 +179,8 @@ struct db_io_info : public game_info
 	bit_array fp_w, fp_b, fp_caps;
 	std::vector<unsigned char> movelist;
 	unsigned sz_x, sz_y;
+	/* Position of the game in its file, if that holds a collection.  */
+	unsigned game_idx = 0;
 
 	db_io_info (const game_info &i, std::string f, unsigned sx, unsigned sy)
 		: game_info (i), filename (f), fp_w (sx * sy), fp_b (sx * sy), fp_caps (sx * sy), sz_x (sx), sz_y (sy)
@@ -149,30 +192,37 @@ struct db_io_info : public game_info
 	db_io_info &operator=  (db_io_info &&) = default;
 };
 
-static void collect_game_data (std::vector<db_io_info> &vec, const QString &filename, sgf *sgf)
+/* What we remember about each SGF file of a directory, so that an update of
+   its database only needs to look at new or changed files.  */
+struct db_file_stamp
 {
-	try {
-		int size_x, size_y;
-		std::tie (size_x, size_y) = sizes_from_sgfroot (*sgf);
+	std::string filename;
+	uint64_t size, mtime;
+};
 
-		if (size_x > max_db_boardsize || size_y > max_db_boardsize)
-			return;
+/* Add the game in SGF to VEC, unless its board is too large for the database.
+   Throws the usual SGF exceptions if it is broken.  */
+static void collect_game_data (std::vector<db_io_info> &vec, const QString &filename, unsigned game_idx, sgf *sgf)
+{
+	int size_x, size_y;
+	std::tie (size_x, size_y) = sizes_from_sgfroot (*sgf);
 
-		go_board b (size_x, size_y);
-		unsigned sz = b.bitsize ();
+	if (size_x > max_db_boardsize || size_y > max_db_boardsize)
+		return;
 
-		sgf_errors errs;
-		db_io_info info (info_from_sgfroot (*sgf, nullptr, errs), filename.toStdString (), b.size_x (), b.size_y ());
-		bit_array w_stones (sz);
-		bit_array b_stones (sz);
-		bit_array caps (sz);
+	go_board b (size_x, size_y);
+	unsigned sz = b.bitsize ();
 
-		info.movelist.reserve (600);
-		db_info_from_sgf (b, sgf->nodes, true, errs, info.fp_w, info.fp_b, info.fp_caps, info.movelist);
-		vec.emplace_back (std::move (info));
-	} catch (...) {
-		return;
-	}
+	sgf_errors errs;
+	db_io_info info (info_from_sgfroot (*sgf, nullptr, errs), filename.toStdString (), b.size_x (), b.size_y ());
+	info.game_idx = game_idx;
+	bit_array w_stones (sz);
+	bit_array b_stones (sz);
+	bit_array caps (sz);
+
+	info.movelist.reserve (600);
+	db_info_from_sgf (b, sgf->nodes, true, errs, info.fp_w, info.fp_b, info.fp_caps, info.movelist);
+	vec.emplace_back (std::move (info));
 }
 
 class db_errors_found : public std::exception
@@ -219,6 +269,11 @@ static bool write_uint32 (QDataStream &ds, uint32_t val)
 	return ds.writeRawData ((char *)data, 4) == 4;
 }
 
+static bool write_uint64 (QDataStream &ds, uint64_t val)
+{
+	return write_uint32 (ds, val & 0xFFFFFFFF) && write_uint32 (ds, val >> 32);
+}
+
 template<class T>
 uint32_t read_uint (QDataStream &ds)
 {
@@ -230,7 +285,29 @@ uint32_t read_uint (QDataStream &ds)
 	return v;
 }
 
-static bool write_string_id (QDataStream &ds, std::unordered_map<std::string, unsigned> &map, const std::string &data)
+static void read_raw_data (QDataStream &ds, void *buf, int len)
+{
+	if (ds.readRawData ((char *)buf, len) != len)
+		throw db_errors_found ();
+}
+
+static std::string read_string (QDataStream &ds, std::vector<char> &buf)
+{
+	std::string s;
+	uint16_t len = read_uint<uint16_t> (ds);
+	if (len == 0)
+		return "";
+
+	s.reserve (len);
+	buf.resize (len);
+
+	read_raw_data (ds, &buf[0], len);
+	s.append (&buf[0], len);
+	return s;
+}
+
+static bool write_string_id (QDataStream &ds, std::unordered_map<std::string, unsigned> &map, const std::string &data,
+			     bool wide)
 {
 	auto it = map.find (data);
 	/* Strings that are too large are not entered into the map.  */
@@ -240,7 +317,7 @@ static bool write_string_id (QDataStream &ds, std::unordered_map<std::string, un
 	if (it == map.end ())
 		abort ();
 #endif
-	if (map.size () < 65536)
+	if (!wide)
 		return write_uint16 (ds, (*it).second);
 	else
 		return write_uint32 (ds, (*it).second);
@@ -251,46 +328,351 @@ static bool write_raw_data (QDataStream &ds, const void *p, size_t len)
 	return (size_t)ds.writeRawData ((char *)p, len) == len;
 }
 
-static sgf *read_sgf_file (const QString &filename)
+static uint64_t read_uint64 (QDataStream &ds)
+{
+	uint64_t lo = read_uint<uint32_t> (ds);
+	uint64_t hi = read_uint<uint32_t> (ds);
+	return lo | (hi << 32);
+}
+
+/* Writes the bit streams read by db_bit_reader.  */
+class db_bit_writer
+{
+	std::vector<unsigned char> &m_out;
+	uint64_t m_bits = 0;
+	unsigned m_n_bits = 0;
+
+public:
+	db_bit_writer (std::vector<unsigned char> &out) : m_out (out)
+	{
+	}
+	~db_bit_writer ()
+	{
+		if (m_n_bits > 0)
+			m_out.push_back (m_bits);
+	}
+	void put (uint32_t v, unsigned n)
+	{
+		m_bits |= (uint64_t)v << m_n_bits;
+		m_n_bits += n;
+		while (m_n_bits >= 8) {
+			m_out.push_back (m_bits & 255);
+			m_bits >>= 8;
+			m_n_bits -= 8;
+		}
+	}
+	void put_gamma (uint32_t v)
+	{
+		unsigned n = 0;
+		while ((v >> n) > 1)
+			n++;
+		put (0, n);
+		put (1, 1);
+		put (v & (((uint32_t)1 << n) - 1), n);
+	}
+};
+
+static unsigned gamma_bits (uint32_t v)
+{
+	unsigned n = 0;
+	while ((v >> n) > 1)
+		n++;
+	return 2 * n + 1;
+}
+
+/* Pack the plain MOVELIST of a game on a board of SX by SY into the encoding
+   described with movelist_decoder.  Returns false if the result does not
+   decode to the same tokens, in which case the plain encoding must be used.  */
+static bool pack_movelist (const std::vector<unsigned char> &movelist, unsigned sx, unsigned sy,
+			   std::vector<unsigned char> &out)
+{
+	size_t n_tokens = movelist.size () / 2;
+	if (movelist.size () % 2 != 0 || n_tokens + 1 > 0xFFFFFFFF)
+		return false;
+	unsigned point_bits = 1;
+	while ((1u << point_bits) < sx * sy)
+		point_bits++;
+	{
+		db_bit_writer w (out);
+		w.put_gamma (n_tokens + 1);
+		int expected = db_mv_flag_black;
+		for (size_t i = 0; i < movelist.size (); i += 2) {
+			int x = movelist[i];
+			int y = movelist[i + 1];
+			int col = y & (db_mv_flag_black | db_mv_flag_white);
+			if (col == 0) {
+				if (x == db_mv_flag_branch)
+					w.put (7, 4);
+				else if (x == db_mv_flag_endvar)
+					w.put (15, 5);
+				else
+					w.put (31, 5);
+				continue;
+			}
+			bool end = (x & db_mv_flag_node_end) != 0;
+			bool del = (y & db_mv_flag_delete) != 0;
+			unsigned p = (y & 31) * sx + (x & 31);
+			if (end && !del && col == expected)
+				w.put (0, 1);
+			else if (end && !del)
+				w.put (1, 2);
+			else {
+				w.put (3, 3);
+				w.put (col == db_mv_flag_black, 1);
+				w.put (del, 1);
+				w.put (end, 1);
+			}
+			w.put (p, point_bits);
+			if (!del)
+				expected = col ^ (db_mv_flag_black | db_mv_flag_white);
+		}
+	}
+	/* Boards larger than the flags allow, or data we do not understand, are
+	   caught here.  */
+	movelist_decoder dec ((const char *)out.data (), out.size (), true, sx, sy);
+	size_t i = 0;
+	int x, y;
+	while (dec.next (x, y)) {
+		if (i + 1 >= movelist.size () || x != (signed char)movelist[i] || y != (signed char)movelist[i + 1])
+			return false;
+		i += 2;
+	}
+	return i == movelist.size ();
+}
+
+/* The captures bitmap of a game is packed into a bit stream in version 5
+   files, either as raw bits or, if shorter, as the gaps between its set bits
+   in gamma code, preceded by a bit to tell which.  */
+static void pack_bitmap (db_bit_writer &w, const bit_array &bits, unsigned n_points)
+{
+	unsigned sparse = 0, count = 0, gap = 0;
+	for (unsigned i = 0; i < n_points; i++) {
+		if (bits.test_bit (i)) {
+			sparse += gamma_bits (gap + 1);
+			count++;
+			gap = 0;
+		} else
+			gap++;
+	}
+	sparse += gamma_bits (count + 1);
+	bool use_sparse = sparse < n_points;
+	w.put (use_sparse, 1);
+	if (!use_sparse) {
+		for (unsigned i = 0; i < n_points; i++)
+			w.put (bits.test_bit (i), 1);
+		return;
+	}
+	w.put_gamma (count + 1);
+	gap = 0;
+	for (unsigned i = 0; i < n_points; i++) {
+		if (bits.test_bit (i)) {
+			w.put_gamma (gap + 1);
+			gap = 0;
+		} else
+			gap++;
+	}
+}
+
+/* Returns false if the bitmap refers to points beyond N_POINTS.  */
+static bool unpack_bitmap (db_bit_reader &r, bit_array &bits, unsigned n_points)
+{
+	if (r.get (1) == 0) {
+		for (unsigned i = 0; i < n_points; i++)
+			if (r.get (1))
+				bits.set_bit (i);
+		return true;
+	}
+	uint32_t count = r.get_gamma () - 1;
+	uint32_t i = 0;
+	for (uint32_t k = 0; k < count && !r.overrun (); k++) {
+		uint32_t gap = r.get_gamma () - 1;
+		if (gap >= n_points - i)
+			return false;
+		i += gap;
+		bits.set_bit (i++);
+	}
+	return true;
+}
+
+static void pack_caps (const bit_array &c, unsigned n_points, std::vector<unsigned char> &out)
 {
-	QFile f (filename);
-	f.open (QIODevice::ReadOnly);
+	out.clear ();
+	db_bit_writer wr (out);
+	pack_bitmap (wr, c, n_points);
+}
 
+/* Returns false if the data was cut short or inconsistent.  */
+static bool unpack_caps (const char *p, size_t len, unsigned n_points, bit_array &c)
+{
+	db_bit_reader r (p, len);
+	return unpack_bitmap (r, c, n_points) && !r.overrun ();
+}
+
+/* Return the bitmap of the points where stones were captured.  Entries from
+   version 5 files only unpack it, into SCRATCH, when a pattern search needs
+   it, so that loading a database does not have to touch every game.  */
+const bit_array &gamedb_entry::final_caps (bit_array &scratch) const
+{
+	if (finalpos_c_map == nullptr)
+		return finalpos_c;
+	unsigned n_points = sz_x * sz_y;
+	if (scratch.bitsize () != n_points)
+		scratch = bit_array (n_points);
+	else
+		scratch.clear ();
+	/* A damaged bitmap only costs matches; the reader stays in bounds.  */
+	unpack_caps (finalpos_c_map, finalpos_c_len, n_points, scratch);
+	return scratch;
+}
+
+/* Add all games found in the file at PATH, which may hold a collection of
+   them.  Returns false if the file could not be read, or if some of its games
+   could not be parsed; the others are still added in that case.  */
+static bool collect_file_data (std::vector<db_io_info> &vec, const QString &path, const QString &filename)
+{
+	QFile f (path);
+	if (!f.open (QIODevice::ReadOnly))
+		return false;
+
+	IODeviceAdapter in (f);
+	std::vector<sgf_game_span> spans;
 	try {
-		sgf *sgf = load_sgf (f);
-		f.close ();
-		return sgf;
-	} catch (...) {
-		return nullptr;
+		spans = sgf_collection_index (path, in);
+	} catch (premature_eof &) {
+		return false;
+	} catch (broken_sgf &) {
+		return false;
 	}
-	f.close ();
-	return nullptr;
+	bool ok = true;
+	for (size_t i = 0; i < spans.size (); i++) {
+		try {
+			std::unique_ptr<sgf> s (load_sgf (in.data () + spans[i].offset, spans[i].length));
+			collect_game_data (vec, filename, i, s.get ());
+		} catch (premature_eof &) {
+			ok = false;
+		} catch (broken_sgf &) {
+			ok = false;
+		} catch (invalid_boardsize &) {
+			ok = false;
+		} catch (old_sgf_format &) {
+			ok = false;
+		}
+	}
+	return ok;
 }
 
-bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &dirname)
+/* Read the games and the file manifest of an existing q5go.db in DIR, for
+   an update of the database.  The games are grouped by their file name.
+   Returns false if there is no usable file, or if it predates manifests.  */
+static bool read_db_for_update (const QDir &dir, std::unordered_map<std::string, std::vector<db_io_info>> &games,
+				std::unordered_map<std::string, db_file_stamp> &manifest)
 {
-	QDir dir (dirname);
-	QStringList pat;
-	pat << "*.[Ss][Gg][Ff]";
-	QStringList entries = dir.entryList (pat, QDir::Files);
+	QFile f (dir.filePath ("q5go.db"));
+	if (!f.open (QIODevice::ReadOnly))
+		return false;
+	QDataStream ds (&f);
+	/* Nothing in the file can be larger than the file itself.  */
+	uint64_t file_size = f.size ();
 
-	dlg.setMaximum (entries.size ());
-	int p_count = 0;
-	std::vector<db_io_info> collection;
-	for (auto filename: entries) {
-		if (filename.size () >= 32768)
-			continue;
-		qDebug () << filename;
-		sgf *sgf = read_sgf_file (dir.filePath (filename));
-		if (sgf != nullptr) {
-			collect_game_data (collection, filename, sgf);
-			dlg.setValue (++p_count);
-			delete sgf;
-		}
-		if (dlg.wasCanceled ())
+	try {
+		char id[5];
+		id[4] = 0;
+		if (ds.readRawData (id, 4) != 4 || strcmp (id, "q5db") != 0)
+			return false;
+		uint32_t version = read_uint<uint32_t> (ds);
+		if (version < 3 || version > 5)
+			return false;
+		uint32_t n_strings = read_uint<uint32_t> (ds);
+		if (n_strings > file_size)
 			return false;
+		std::vector<std::string> strtable;
+		std::vector<char> buf;
+		for (uint32_t i = 0; i < n_strings; i++)
+			strtable.emplace_back (read_string (ds, buf));
+		uint32_t (*read_str_id) (QDataStream &) = n_strings < 65536 ? read_uint<uint16_t> : read_uint<uint32_t>;
+		auto str = [&] () -> const std::string &
+			{
+				uint32_t id = read_str_id (ds);
+				if (id >= n_strings)
+					throw db_errors_found ();
+				return strtable[id];
+			};
+
+		uint32_t n_games = read_uint<uint32_t> (ds);
+		for (uint32_t i = 0; i < n_games; i++) {
+			std::string filename = read_string (ds, buf);
+			uint32_t sx = read_uint<uint16_t> (ds);
+			uint32_t sy = read_uint<uint16_t> (ds);
+			if (sx > max_db_boardsize || sy > max_db_boardsize)
+				return false;
+
+			game_info gi;
+			gi.name_w = str ();
+			gi.rank_w = str ();
+			gi.name_b = str ();
+			gi.rank_b = str ();
+			gi.result = str ();
+			gi.date = str ();
+			gi.event = str ();
+			db_io_info info (gi, filename, sx, sy);
+			read_raw_data (ds, info.fp_w.raw_bits (), info.fp_w.raw_n_elts () * sizeof (uint64_t));
+			read_raw_data (ds, info.fp_b.raw_bits (), info.fp_b.raw_n_elts () * sizeof (uint64_t));
+			if (version < 5)
+				read_raw_data (ds, info.fp_caps.raw_bits (), info.fp_caps.raw_n_elts () * sizeof (uint64_t));
+			else {
+				uint32_t caps_len = read_uint<uint16_t> (ds);
+				buf.resize (caps_len);
+				read_raw_data (ds, buf.data (), caps_len);
+				if (!unpack_caps (buf.data (), caps_len, sx * sy, info.fp_caps))
+					return false;
+			}
+			uint32_t msz = read_uint<uint32_t> (ds);
+			if (msz > file_size)
+				return false;
+			info.movelist.resize (msz);
+			if (msz > 0)
+				read_raw_data (ds, &info.movelist[0], msz);
+			/* Unpack the movelist; it is packed again when writing.  */
+			if (version >= 5 && msz > 0) {
+				std::vector<unsigned char> packed;
+				packed.swap (info.movelist);
+				movelist_decoder dec ((const char *)packed.data () + 1, msz - 1, packed[0] != 0, sx, sy);
+				int x, y;
+				while (dec.next (x, y)) {
+					info.movelist.push_back (x);
+					info.movelist.push_back (y);
+				}
+			}
+
+			uint32_t skip = read_uint<uint32_t> (ds);
+			if (skip >= 4) {
+				info.game_idx = read_uint<uint32_t> (ds);
+				skip -= 4;
+			}
+			ds.skipRawData (skip);
+			games[filename].emplace_back (std::move (info));
+		}
+
+		uint32_t n_files = read_uint<uint32_t> (ds);
+		for (uint32_t i = 0; i < n_files; i++) {
+			db_file_stamp stamp;
+			stamp.filename = read_string (ds, buf);
+			stamp.size = read_uint64 (ds);
+			stamp.mtime = read_uint64 (ds);
+			manifest[stamp.filename] = stamp;
+		}
+	} catch (...) {
+		return false;
 	}
+	return true;
+}
 
+/* Intern the strings of COLLECTION and write it to the q5go.db file in DIR,
+   along with the MANIFEST of the files it was made from.
+   Runs on a thread of its own, and stops early if CANCEL is set.  */
+static bool write_db_file (const QDir &dir, const std::vector<db_io_info> &collection,
+			   const std::vector<db_file_stamp> &manifest, const std::atomic<bool> &cancel)
+{
 	std::unordered_map<std::string, unsigned> map;
 	std::vector<const std::string *> str_array;
 	unsigned id = 0;
@@ -319,10 +701,32 @@ bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &
 	char qid[] = { 'q', '5', 'd', 'b' };
 	success &= write_raw_data (ds, qid, 4);
 
-	/* A version number.  */
-	success &= write_uint32 (ds, 1);
-	uint32_t count = map.size ();
+	/* A version number.  Version 2 adds a block of extra data to each game,
+	   which holds its index within a collection file.  Version 3 appends a
+	   manifest of the SGF files after the games; older readers stop before
+	   it.
+	   Version 4 adds padding so that the final position bitmaps of every game
+	   start at a multiple of 8 bytes, and can be used in place when the file
+	   is mapped into memory.  The padding goes where older readers already
+	   skip data: into an unused string at the end of the string table, and
+	   into the extra data block of the previous game.
+	   Version 5 packs the captures bitmap and the movelist into bit streams,
+	   see pack_caps and pack_movelist.  The white and black bitmaps stay as
+	   they are, for use in place.  */
+	uint32_t version = 5;
+	success &= write_uint32 (ds, version);
+	uint32_t count = map.size () + 1;
 	success &= write_uint32 (ds, count);
+	bool wide_ids = count >= 65536;
+
+	static const char zeros[8] = { 0 };
+	auto padding = [] (size_t pos) -> size_t { return (8 - pos % 8) % 8; };
+	/* The size of the record for game I up to its bitmaps.  */
+	auto record_head = [&] (size_t i) -> size_t
+		{
+			return 2 + collection[i].filename.size () + 4 + 7 * (wide_ids ? 4 : 2);
+		};
+	size_t pos = 12;
 
 	for (size_t i = 0; i < str_array.size (); i++) {
 		const std::string &d = *str_array[i];
@@ -332,9 +736,27 @@ bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &
 		success &= write_uint16 (ds, size);
 		if (size > 0)
 			success &= write_raw_data (ds, &d[0], size);
+		pos += 2 + size;
 	}
+	size_t fill = collection.empty () ? 0 : padding (pos + 2 + 4 + record_head (0));
+	success &= write_uint16 (ds, fill);
+	success &= write_raw_data (ds, zeros, fill);
+	pos += 2 + fill;
+
 	success &= write_uint32 (ds, collection.size ());
-	for (auto &d: collection) {
+	pos += 4;
+	std::vector<unsigned char> packed, caps;
+	for (size_t i = 0; i < collection.size (); i++) {
+		if (cancel) {
+			success = false;
+			break;
+		}
+		const db_io_info &d = collection[i];
+		pos += record_head (i);
+#ifdef CHECKING
+		if (pos % 8 != 0)
+			abort ();
+#endif
 		const std::string &str = d.filename;
 		uint32_t size = str.size ();
 		success &= write_uint16 (ds, size);
@@ -342,18 +764,42 @@ bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &
 
 		success &= write_uint16 (ds, d.sz_x);
 		success &= write_uint16 (ds, d.sz_y);
-		success &= write_string_id (ds, map, d.name_w);
-		success &= write_string_id (ds, map, d.rank_w);
-		success &= write_string_id (ds, map, d.name_b);
-		success &= write_string_id (ds, map, d.rank_b);
-		success &= write_string_id (ds, map, d.result);
-		success &= write_string_id (ds, map, d.date);
-		success &= write_string_id (ds, map, d.event);
-		success &= write_raw_data (ds, d.fp_w.raw_bits (), d.fp_w.raw_n_elts () * sizeof (uint64_t));
-		success &= write_raw_data (ds, d.fp_b.raw_bits (), d.fp_b.raw_n_elts  () * sizeof (uint64_t));
-		success &= write_raw_data (ds, d.fp_caps.raw_bits (), d.fp_caps.raw_n_elts () * sizeof (uint64_t));
-		success &= write_uint32 (ds, d.movelist.size ());
-		success &= write_raw_data (ds, &d.movelist[0], d.movelist.size ());
+		success &= write_string_id (ds, map, d.name_w, wide_ids);
+		success &= write_string_id (ds, map, d.rank_w, wide_ids);
+		success &= write_string_id (ds, map, d.name_b, wide_ids);
+		success &= write_string_id (ds, map, d.rank_b, wide_ids);
+		success &= write_string_id (ds, map, d.result, wide_ids);
+		success &= write_string_id (ds, map, d.date, wide_ids);
+		success &= write_string_id (ds, map, d.event, wide_ids);
+		size_t bitmap_size = d.fp_w.raw_n_elts () * sizeof (uint64_t);
+		success &= write_raw_data (ds, d.fp_w.raw_bits (), bitmap_size);
+		success &= write_raw_data (ds, d.fp_b.raw_bits (), bitmap_size);
+		pack_caps (d.fp_caps, d.sz_x * d.sz_y, caps);
+		success &= write_uint16 (ds, caps.size ());
+		success &= write_raw_data (ds, caps.data (), caps.size ());
+
+		/* The movelist starts with a byte that tells whether it is packed.  */
+		packed.clear ();
+		bool use_packed = pack_movelist (d.movelist, d.sz_x, d.sz_y, packed);
+		const std::vector<unsigned char> &ml = use_packed ? packed : d.movelist;
+		success &= write_uint32 (ds, 1 + ml.size ());
+		unsigned char format = use_packed;
+		success &= write_raw_data (ds, &format, 1);
+		success &= write_raw_data (ds, ml.data (), ml.size ());
+		pos += 2 * bitmap_size + 2 + caps.size () + 4 + 1 + ml.size ();
+
+		size_t pad = i + 1 == collection.size () ? 0 : padding (pos + 8 + record_head (i + 1));
+		success &= write_uint32 (ds, 4 + pad);
+		success &= write_uint32 (ds, d.game_idx);
+		success &= write_raw_data (ds, zeros, pad);
+		pos += 8 + pad;
+	}
+	success &= write_uint32 (ds, manifest.size ());
+	for (auto &m: manifest) {
+		success &= write_uint16 (ds, m.filename.size ());
+		success &= write_raw_data (ds, &m.filename[0], m.filename.size ());
+		success &= write_uint64 (ds, m.size);
+		success &= write_uint64 (ds, m.mtime);
 	}
 	success &= f.flush ();
 	f.close ();
@@ -369,117 +815,427 @@ bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &
 	return success;
 }
 
-static void read_raw_data (QDataStream &ds, void *buf, int len)
+/* Building a database is a pipeline: the files are parsed and their data
+   extracted by jobs in a thread pool, then the results are merged in the order
+   of the file list and written by a single job, so that the file contents do
+   not depend on the number of threads.  */
+
+class DBIndexJob : public QRunnable
 {
-	if (ds.readRawData ((char *)buf, len) != len)
-		throw db_errors_found ();
+	QDir m_dir;
+	const QStringList &m_files;
+	/* Indices into M_FILES of the files that need to be parsed.  */
+	const std::vector<size_t> &m_todo;
+	std::vector<std::vector<db_io_info>> &m_results;
+	size_t m_first, m_end;
+	std::atomic<int> &m_progress;
+	std::atomic<int> &m_failed;
+	const std::atomic<bool> &m_cancel;
+
+public:
+	DBIndexJob (const QDir &dir, const QStringList &files, const std::vector<size_t> &todo,
+		    std::vector<std::vector<db_io_info>> &r, size_t first, size_t end,
+		    std::atomic<int> &progress, std::atomic<int> &failed, const std::atomic<bool> &cancel)
+		: m_dir (dir), m_files (files), m_todo (todo), m_results (r), m_first (first), m_end (end),
+		  m_progress (progress), m_failed (failed), m_cancel (cancel)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		for (size_t j = m_first; j < m_end && !m_cancel; j++) {
+			size_t i = m_todo[j];
+			const QString &filename = m_files[i];
+			if (!collect_file_data (m_results[i], m_dir.filePath (filename), filename))
+				m_failed++;
+			m_progress++;
+		}
+	}
+};
+
+class DBWriteJob : public QRunnable
+{
+	const QDir &m_dir;
+	const std::vector<db_io_info> &m_collection;
+	const std::vector<db_file_stamp> &m_manifest;
+	const std::atomic<bool> &m_cancel;
+	bool &m_success;
+
+public:
+	DBWriteJob (const QDir &dir, const std::vector<db_io_info> &c, const std::vector<db_file_stamp> &m,
+		    const std::atomic<bool> &cancel, bool &success)
+		: m_dir (dir), m_collection (c), m_manifest (m), m_cancel (cancel), m_success (success)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		m_success = write_db_file (m_dir, m_collection, m_manifest, m_cancel);
+	}
+};
+
+/* Wait for the jobs in POOL, passing PROGRESS out of TOTAL to POLL every now
+   and then.  Returns false if POLL asked to cancel, after the jobs have
+   stopped.  */
+static bool wait_for_jobs (QThreadPool &pool, const std::atomic<int> &progress, int total,
+			   std::atomic<bool> &cancel, const db_build_progress &poll)
+{
+	while (!pool.waitForDone (50)) {
+		if (!poll (progress, total)) {
+			cancel = true;
+			pool.waitForDone ();
+			return false;
+		}
+	}
+	return poll (progress, total);
 }
 
-static std::string read_string (QDataStream &ds, std::vector<char> &buf)
+/* Create the database file for DIRNAME, parsing files in N_JOBS threads, or
+   one per processor if it is zero.  If UPDATE is true and there is an
+   existing database with a manifest, only new or changed files are parsed;
+   the games of unchanged files are carried over, and those of deleted files
+   are dropped.  POLL is called regularly with the progress and can cancel
+   the build.  STATS is filled in with what was found.  */
+bool build_db_for_dir (const QString &dirname, bool update, int n_jobs,
+		       const db_build_progress &poll, db_build_stats &stats)
 {
-	std::string s;
-	uint16_t len = read_uint<uint16_t> (ds);
-	if (len == 0)
-		return "";
+	QDir dir (dirname);
+	QStringList pat;
+	pat << "*.[Ss][Gg][Ff]";
+	QStringList entries;
+	std::vector<db_file_stamp> manifest;
+	for (auto &fi: dir.entryInfoList (pat, QDir::Files)) {
+		QString filename = fi.fileName ();
+		if (filename.size () >= 32768)
+			continue;
+		entries << filename;
+		manifest.push_back ({ filename.toStdString (), (uint64_t)fi.size (),
+				      (uint64_t)fi.lastModified ().toMSecsSinceEpoch () });
+	}
 
-	s.reserve (len);
-	buf.resize (len);
+	std::vector<std::vector<db_io_info>> results (entries.size ());
+	std::vector<size_t> todo;
+	std::unordered_map<std::string, std::vector<db_io_info>> old_games;
+	std::unordered_map<std::string, db_file_stamp> old_manifest;
+	bool have_old = update && read_db_for_update (dir, old_games, old_manifest);
+	for (size_t i = 0; i < manifest.size (); i++) {
+		const db_file_stamp &m = manifest[i];
+		auto it = have_old ? old_manifest.find (m.filename) : old_manifest.end ();
+		if (it != old_manifest.end () && it->second.size == m.size && it->second.mtime == m.mtime) {
+			results[i] = std::move (old_games[m.filename]);
+			old_manifest.erase (it);
+		} else
+			todo.push_back (i);
+	}
+	stats.n_files = entries.size ();
+	stats.n_parsed = todo.size ();
+	/* Anything left in OLD_MANIFEST has been deleted or changed.  */
+	if (have_old && old_manifest.empty () && todo.empty ()) {
+		stats.unchanged = true;
+		for (auto &r: results)
+			stats.n_games += r.size ();
+		return true;
+	}
+	old_games.clear ();
+
+	std::atomic<int> progress { 0 };
+	std::atomic<int> failed { 0 };
+	std::atomic<bool> cancel { false };
+
+	QThreadPool pool;
+	if (n_jobs > 0)
+		pool.setMaxThreadCount (n_jobs);
+	/* Small enough to balance the load, large enough to keep the overhead low.  */
+	size_t chunk = 16;
+	for (size_t i = 0; i < todo.size (); i += chunk)
+		pool.start (new DBIndexJob (dir, entries, todo, results, i,
+					    std::min (todo.size (), i + chunk), progress, failed, cancel));
+	bool completed = wait_for_jobs (pool, progress, todo.size (), cancel, poll);
+	stats.n_failed = failed;
+	if (!completed)
+		return false;
 
-	read_raw_data (ds, &buf[0], len);
-	s.append (&buf[0], len);
-	return s;
+	std::vector<db_io_info> collection;
+	for (auto &r: results)
+		for (auto &d: r)
+			collection.emplace_back (std::move (d));
+	results.clear ();
+	stats.n_games = collection.size ();
+
+	bool success = false;
+	pool.start (new DBWriteJob (dir, collection, manifest, cancel, success));
+	if (!wait_for_jobs (pool, progress, todo.size (), cancel, poll))
+		return false;
+	return success;
 }
 
-bool GameDB_Data::read_q5go_db (const QDir &dbdir, int base_id, unsigned max_mb, bool read_movelist)
+bool PreferencesDialog::create_db_for_dir (QProgressDialog &dlg, const QString &dirname, bool update)
 {
-	QFile f (dbdir.filePath ("q5go.db"));
-	f.open (QIODevice::ReadOnly);
-	QDataStream ds (&f);
+	db_build_stats stats;
+	return build_db_for_dir (dirname, update, 0,
+				 [&dlg] (int done, int total) -> bool
+				 {
+					 dlg.setMaximum (total);
+					 dlg.setValue (done);
+					 QCoreApplication::processEvents ();
+					 return !dlg.wasCanceled ();
+				 }, stats);
+}
 
-	try {
-		char id[5];
-		id[4] = 0;
-		if (ds.readRawData (id, 4) != 4 || strcmp (id, "q5db") != 0)
-			throw db_errors_found ();
-		int version = read_uint<uint32_t> (ds);
-		uint32_t n_strings = read_uint<uint32_t> (ds);
-		uint32_t total = 12;
-		std::vector<QString> strtable;
-		std::vector<char> buf;
-		for (uint32_t i = 0; i < n_strings; i++) {
-			std::string s = read_string (ds, buf);
-			strtable.emplace_back (QString::fromStdString (s));
-			total += s.size () + 2;
+/* The contents of a q5go.db file.  Where possible the file is mapped into
+   memory, so that loading it costs page faults rather than copies, and the
+   pages are shared between processes.  Entries refer to this memory for their
+   final positions and movelists, so it must be kept for as long as they are.  */
+class db_file_data
+{
+	QFile m_file;
+	QByteArray m_copy;
+	const char *m_data = nullptr;
+	size_t m_size = 0;
+
+public:
+	db_file_data (const QString &filename)
+		: m_file (filename)
+	{
+		if (!m_file.open (QIODevice::ReadOnly))
+			return;
+		m_size = m_file.size ();
+#ifndef Q_OS_WIN
+		/* Windows does not allow a mapped file to be replaced, which would
+		   get in the way of recreating the database while it is loaded.  */
+		m_data = (const char *)m_file.map (0, m_size);
+#endif
+		if (m_data == nullptr) {
+			m_copy = m_file.readAll ();
+			m_data = m_copy.constData ();
+			m_size = m_copy.size ();
+			m_file.close ();
 		}
-		uint32_t (*read_str_id) (QDataStream &) = n_strings < 65536 ? read_uint<uint16_t> : read_uint<uint32_t>;
-		int strid_sz = n_strings < 65536 ? 2 : 4;
-		uint32_t n_games = read_uint<uint32_t> (ds);
-		total += 4;
-		if ((total + n_games * (strid_sz * 7 + 4)) / 1024 / 1024 > max_mb)
-			throw db_too_large ();
+	}
+	const char *data () const { return m_data; }
+	size_t size () const { return m_size; }
+};
 
-		for (uint32_t i = 0; i < n_games; i++) {
-			std::string f = read_string (ds, buf);
-			QString filename = QString::fromStdString (f);
-			total += f.size () + 2;
-			uint32_t sx = read_uint<uint16_t> (ds);
-			uint32_t sy = read_uint<uint16_t> (ds);
-			if (sx > max_db_boardsize || sy > max_db_boardsize)
+/* Bounds-checked reading from a q5go.db file in memory.  */
+class db_reader
+{
+	const char *m_data;
+	size_t m_size;
+	size_t m_pos = 0;
+
+public:
+	db_reader (const db_file_data &f) : m_data (f.data ()), m_size (f.size ())
+	{
+	}
+	size_t pos () const { return m_pos; }
+	const char *get (size_t len)
+	{
+		if (m_data == nullptr || len > m_size - m_pos)
+			throw db_errors_found ();
+		const char *p = m_data + m_pos;
+		m_pos += len;
+		return p;
+	}
+	template<class T>
+	uint32_t read_uint ()
+	{
+		T v;
+		memcpy (&v, get (sizeof v), sizeof v);
+		return v;
+	}
+	QString read_string ()
+	{
+		uint32_t len = read_uint<uint16_t> ();
+		return QString::fromUtf8 (get (len), len);
+	}
+};
+
+/* The games of one database directory.  The directories are read in
+   parallel, so each segment has its own string table, and its game ids
+   start at zero, until do_load merges them in the order of the paths.  */
+struct db_segment
+{
+	std::vector<gamedb_entry> entries;
+	std::vector<QString> strings;
+	QHash<QString, unsigned> string_ids;
+	std::shared_ptr<const db_file_data> file;
+	bool queued = false;
+	bool errors_found = false;
+	bool too_large = false;
+	qint64 msecs = 0;
+
+	unsigned intern (const QString &s)
+	{
+		auto it = string_ids.find (s);
+		if (it != string_ids.end ())
+			return *it;
+		unsigned id = strings.size ();
+		strings.push_back (s);
+		string_ids.insert (s, id);
+		return id;
+	}
+};
+
+static void read_q5go_db (const QDir &dbdir, db_segment &seg, unsigned max_mb)
+{
+	auto file = std::make_shared<const db_file_data> (dbdir.filePath ("q5go.db"));
+	if (file->size () / 1024 / 1024 > max_mb)
+		throw db_too_large ();
+
+	db_reader r (*file);
+	if (memcmp (r.get (4), "q5db", 4) != 0)
+		throw db_errors_found ();
+	uint32_t version = r.read_uint<uint32_t> ();
+	if (version > 5)
+		throw db_errors_found ();
+	uint32_t n_strings = r.read_uint<uint32_t> ();
+	if (n_strings > file->size ())
+		throw db_errors_found ();
+	/* Map the file's string table to ours.  */
+	std::vector<unsigned> strtable;
+	strtable.reserve (n_strings);
+	for (uint32_t i = 0; i < n_strings; i++)
+		strtable.push_back (seg.intern (r.read_string ()));
+	/* Many games share a date, so convert each one only once.  */
+	std::vector<unsigned> dates (n_strings);
+	std::vector<bool> date_done (n_strings);
+
+	bool wide_ids = n_strings >= 65536;
+	auto read_str_id = [&] () -> uint32_t
+		{
+			uint32_t id = wide_ids ? r.read_uint<uint32_t> () : r.read_uint<uint16_t> ();
+			if (id >= n_strings)
 				throw db_errors_found ();
+			return id;
+		};
+	uint32_t n_games = r.read_uint<uint32_t> ();
+	if (n_games > file->size ())
+		throw db_errors_found ();
+	std::vector<gamedb_entry> &entries = seg.entries;
+	entries.reserve (n_games);
+
+	unsigned dirname = seg.intern (dbdir.absolutePath ());
+	for (uint32_t i = 0; i < n_games; i++) {
+		unsigned filename = seg.intern (r.read_string ());
+		uint32_t sx = r.read_uint<uint16_t> ();
+		uint32_t sy = r.read_uint<uint16_t> ();
+		if (sx > max_db_boardsize || sy > max_db_boardsize)
+			throw db_errors_found ();
 
-			uint32_t nmw_id = read_str_id (ds);
-			uint32_t rkw_id = read_str_id (ds);
-			uint32_t nmb_id = read_str_id (ds);
-			uint32_t rkb_id = read_str_id (ds);
-			uint32_t res_id = read_str_id (ds);
-			uint32_t dt_id = read_str_id (ds);
-			uint32_t ev_id = read_str_id (ds);
-			total += strid_sz * 7 + 4;
-			m_all_entries.emplace_back (base_id + i, dbdir.absolutePath (), filename,
-						    strtable[nmw_id], strtable[rkw_id],
-						    strtable[nmb_id], strtable[rkb_id],
-						    date_re::convert (strtable[dt_id]),
-						    strtable[res_id], strtable[ev_id],
-						    sx, sy);
-			auto &elt = m_all_entries.back ();
-			uint32_t sz = elt.finalpos_w.raw_n_elts () * sizeof (uint64_t);
-#ifdef CHECKING
-			if (elt.finalpos_w.raw_n_elts () != elt.finalpos_b.raw_n_elts ()
-			    || elt.finalpos_w.raw_n_elts () != elt.finalpos_c.raw_n_elts ())
-				abort ();
-#endif
-			total += 3 * sz;
+		uint32_t nmw_id = read_str_id ();
+		uint32_t rkw_id = read_str_id ();
+		uint32_t nmb_id = read_str_id ();
+		uint32_t rkb_id = read_str_id ();
+		uint32_t res_id = read_str_id ();
+		uint32_t dt_id = read_str_id ();
+		uint32_t ev_id = read_str_id ();
+		if (!date_done[dt_id]) {
+			dates[dt_id] = seg.intern (date_re::convert (seg.strings[strtable[dt_id]]));
+			date_done[dt_id] = true;
+		}
 
-			read_raw_data (ds, elt.finalpos_w.raw_bits (), sz);
-			read_raw_data (ds, elt.finalpos_b.raw_bits (), sz);
-			read_raw_data (ds, elt.finalpos_c.raw_bits (), sz);
+		size_t n_elts = (sx * sy + 63) / 64;
+		if (version >= 5) {
+			/* The captures bitmap is packed, and only unpacked when a
+			   search needs it.  */
+			const char *bits = r.get (2 * n_elts * sizeof (uint64_t));
+			uint32_t caps_len = r.read_uint<uint16_t> ();
+			const char *caps = r.get (caps_len);
+			if ((uintptr_t)bits % alignof (uint64_t) == 0)
+				entries.emplace_back (i, dirname, filename,
+						      strtable[nmw_id], strtable[rkw_id],
+						      strtable[nmb_id], strtable[rkb_id],
+						      dates[dt_id], strtable[res_id], strtable[ev_id],
+						      sx, sy, (const uint64_t *)bits, caps, caps_len);
+			else {
+				entries.emplace_back (i, dirname, filename,
+						      strtable[nmw_id], strtable[rkw_id],
+						      strtable[nmb_id], strtable[rkb_id],
+						      dates[dt_id], strtable[res_id], strtable[ev_id],
+						      sx, sy);
+				auto &elt = entries.back ();
+				size_t sz = n_elts * sizeof (uint64_t);
+				memcpy (elt.finalpos_w.raw_bits (), bits, sz);
+				memcpy (elt.finalpos_b.raw_bits (), bits + sz, sz);
+				if (!unpack_caps (caps, caps_len, sx * sy, elt.finalpos_c))
+					throw db_errors_found ();
+			}
+		} else {
+			const char *bits = r.get (3 * n_elts * sizeof (uint64_t));
+			/* Files written before version 4 may not have the bitmaps
+			   aligned, in which case they are copied.  */
+			if ((uintptr_t)bits % alignof (uint64_t) == 0)
+				entries.emplace_back (i, dirname, filename,
+						      strtable[nmw_id], strtable[rkw_id],
+						      strtable[nmb_id], strtable[rkb_id],
+						      dates[dt_id], strtable[res_id], strtable[ev_id],
+						      sx, sy, (const uint64_t *)bits);
+			else {
+				entries.emplace_back (i, dirname, filename,
+						      strtable[nmw_id], strtable[rkw_id],
+						      strtable[nmb_id], strtable[rkb_id],
+						      dates[dt_id], strtable[res_id], strtable[ev_id],
+						      sx, sy);
+				auto &elt = entries.back ();
+				size_t sz = n_elts * sizeof (uint64_t);
+				memcpy (elt.finalpos_w.raw_bits (), bits, sz);
+				memcpy (elt.finalpos_b.raw_bits (), bits + sz, sz);
+				memcpy (elt.finalpos_c.raw_bits (), bits + 2 * sz, sz);
+			}
+		}
+		auto &elt = entries.back ();
+
+		elt.movelist_off = (r.pos () << 1) | 1;
+		uint32_t msz = r.read_uint<uint32_t> ();
+		elt.movelist_map = r.get (msz);
+		elt.movelist_len = msz;
+		/* In version 5, the first byte tells whether the movelist is packed.  */
+		if (version >= 5 && msz > 0) {
+			elt.movelist_packed = elt.movelist_map[0] != 0;
+			elt.movelist_map++;
+			elt.movelist_len--;
+		}
 
-			elt.movelist_off = (total << 1) | 1;
-			uint32_t msz = read_uint<uint32_t> (ds);
-			total += 4 + msz;
-			if (sz / 1024 / 1024 > max_mb || total / 1024 / 1024 > max_mb)
-				throw db_too_large ();
-
-			if (read_movelist) {
-				elt.movelist.resize (msz);
-				read_raw_data (ds, &elt.movelist[0], msz);
-			} else
-				ds.skipRawData (msz);
-
-			/* Future-proofing.  */
-			if (version > 1) {
-				uint32_t skip = read_uint<uint32_t> (ds);
-				ds.skipRawData (skip);
+		/* Future-proofing.  */
+		if (version > 1) {
+			uint32_t skip = r.read_uint<uint32_t> ();
+			if (skip >= 4) {
+				elt.game_idx = r.read_uint<uint32_t> ();
+				skip -= 4;
 			}
+			r.get (skip);
 		}
-	} catch (...) {
-		f.close ();
-		throw;
 	}
-	f.close ();
-	return true;
+	seg.file = file;
 }
 
+class DBLoadJob : public QRunnable
+{
+	QDir m_dir;
+	db_segment &m_seg;
+	unsigned m_max_mb;
+
+public:
+	DBLoadJob (const QDir &dir, db_segment &seg, unsigned max_mb)
+		: m_dir (dir), m_seg (seg), m_max_mb (max_mb)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		QElapsedTimer timer;
+		timer.start ();
+		try {
+			read_q5go_db (m_dir, m_seg, m_max_mb);
+		} catch (db_errors_found &) {
+			m_seg.errors_found = true;
+		} catch (db_too_large &) {
+			m_seg.too_large = true;
+		}
+		m_seg.msecs = timer.elapsed ();
+	}
+};
+
 /* Read an extra kombilo file (kombilo.da to go with the kombilo.db database).  */
 
 bool GameDB_Data::read_extra_file (QDataStream &ds, int base_id, int boardsize, unsigned max_mb, bool cache_movelist)
@@ -674,29 +1430,253 @@ bool GameDB_Data::read_extra_file (QDataStream &ds, int base_id, int boardsize,
 	return true;
 }
 
+/* Append the games of SEG, which was read by a DBLoadJob, giving them ids
+   from BASE_ID and moving their strings into ours.  */
+void GameDB_Data::add_segment (db_segment &seg, int base_id)
+{
+	std::vector<unsigned> ids;
+	ids.reserve (seg.strings.size ());
+	for (auto &s: seg.strings)
+		ids.push_back (intern (s));
+
+	m_all_entries.reserve (m_all_entries.size () + seg.entries.size ());
+	for (auto &e: seg.entries) {
+		e.id += base_id;
+		e.dirname = ids[e.dirname];
+		e.filename = ids[e.filename];
+		e.pw = ids[e.pw];
+		e.rkw = ids[e.rkw];
+		e.pb = ids[e.pb];
+		e.rkb = ids[e.rkb];
+		e.date = ids[e.date];
+		e.result = ids[e.result];
+		e.event = ids[e.event];
+		m_all_entries.emplace_back (std::move (e));
+	}
+	m_db_files.push_back (std::move (seg.file));
+}
+
+/* Return the index of string S in M_STRINGS, adding it if necessary.  */
+unsigned GameDB_Data::intern (const QString &s)
+{
+	auto it = m_string_ids.find (s);
+	if (it != m_string_ids.end ())
+		return *it;
+	unsigned id = m_strings.size ();
+	m_strings.push_back (s);
+	m_string_ids.insert (s, id);
+	return id;
+}
+
+/* Return the final positions of all games, grouped by board size and stored
+   by columns.  They are only needed for pattern searches, so they are built
+   the first time one is done after loading.  */
+const std::vector<finalpos_store> &GameDB_Data::finalpos_stores ()
+{
+	QMutexLocker lock (&m_finalpos_mutex);
+	if (m_finalpos_valid)
+		return m_finalpos;
+
+	std::map<std::pair<int, int>, size_t> by_size;
+	for (size_t i = 0; i < m_all_entries.size (); i++) {
+		const gamedb_entry &e = m_all_entries[i];
+		auto it = by_size.find ({ e.sz_x, e.sz_y });
+		if (it == by_size.end ()) {
+			it = by_size.insert ({ { e.sz_x, e.sz_y }, m_finalpos.size () }).first;
+			m_finalpos.push_back ({ (unsigned)e.sz_x, (unsigned)e.sz_y, e.finalpos_w.raw_n_elts (), {}, {}, {} });
+		}
+		m_finalpos[it->second].games.push_back (i);
+	}
+	for (auto &s: m_finalpos) {
+		size_t n = s.games.size ();
+		s.w.resize (n * s.n_elts);
+		s.b.resize (n * s.n_elts);
+		for (size_t i = 0; i < n; i++) {
+			const gamedb_entry &e = m_all_entries[s.games[i]];
+			const uint64_t *w = e.finalpos_w.raw_bits ();
+			const uint64_t *b = e.finalpos_b.raw_bits ();
+			for (unsigned k = 0; k < s.n_elts; k++) {
+				s.w[k * n + i] = w[k];
+				s.b[k * n + i] = b[k];
+			}
+		}
+	}
+	m_finalpos_valid = true;
+	return m_finalpos;
+}
+
+static uint64_t trigram_key (const QString &s, int i)
+{
+	return ((uint64_t)s[i].unicode () << 32) | ((uint64_t)s[i + 1].unicode () << 16) | s[i + 2].unicode ();
+}
+
+/* Pack the dates of all entries and sort the entries by them, newest first.  */
+void GameDB_Data::build_date_index ()
+{
+	/* Many games share a date, so convert each one only once.  */
+	std::vector<unsigned> keys (m_strings.size (), date_re::max_key);
+	for (auto &e: m_all_entries) {
+		unsigned &k = keys[e.date];
+		if (k == date_re::max_key)
+			k = date_re::key (m_strings[e.date]);
+		e.date_key = k;
+	}
+
+	size_t n = m_all_entries.size ();
+	m_date_order.resize (n);
+	std::iota (std::begin (m_date_order), std::end (m_date_order), 0);
+	std::stable_sort (std::begin (m_date_order), std::end (m_date_order),
+			  [this] (unsigned a, unsigned b)
+			  {
+				  return m_all_entries[a].date_key > m_all_entries[b].date_key;
+			  });
+	m_date_rank.resize (n);
+	for (unsigned r = 0; r < n; r++)
+		m_date_rank[m_date_order[r]] = r;
+}
+
+/* Index the strings used as player and event names by their trigrams, so
+   that the filters of the database dialog need not look at every one.  Also
+   collect the games using each of them.  Must run after build_date_index.  */
+void GameDB_Data::build_name_index ()
+{
+	std::vector<char> is_name (m_strings.size ());
+	for (auto &e: m_all_entries)
+		is_name[e.pw] = is_name[e.pb] = is_name[e.event] = 1;
+	/* The empty string is contained in everything and never searched for.  */
+	is_name[0] = 0;
+
+	std::vector<uint64_t> keys;
+	for (unsigned id = 0; id < m_strings.size (); id++) {
+		if (!is_name[id])
+			continue;
+		m_name_ids.push_back (id);
+		const QString &s = m_strings[id];
+		keys.clear ();
+		for (int i = 0; i + 3 <= s.length (); i++)
+			keys.push_back (trigram_key (s, i));
+		std::sort (std::begin (keys), std::end (keys));
+		keys.erase (std::unique (std::begin (keys), std::end (keys)), std::end (keys));
+		/* Ids are visited in order, which keeps every list sorted.  */
+		for (auto k: keys)
+			m_trigrams[k].push_back (id);
+	}
+
+	/* Count the games of each string first, then fill in their ranks.
+	   Visiting the games by rank keeps each list sorted.  */
+	m_name_games_start.assign (m_strings.size () + 1, 0);
+	auto for_each_name = [this] (unsigned idx, auto f)
+	{
+		const gamedb_entry &e = m_all_entries[idx];
+		f (e.pw);
+		if (e.pb != e.pw)
+			f (e.pb);
+		if (e.event != e.pw && e.event != e.pb)
+			f (e.event);
+	};
+	for (unsigned idx = 0; idx < m_all_entries.size (); idx++)
+		for_each_name (idx, [this] (unsigned id) { m_name_games_start[id + 1]++; });
+	for (size_t i = 1; i < m_name_games_start.size (); i++)
+		m_name_games_start[i] += m_name_games_start[i - 1];
+	m_name_games.resize (m_name_games_start.back ());
+	std::vector<unsigned> fill (std::begin (m_name_games_start), std::end (m_name_games_start) - 1);
+	for (unsigned r = 0; r < m_date_order.size (); r++)
+		for_each_name (m_date_order[r], [&] (unsigned id) { m_name_games[fill[id]++] = r; });
+}
+
+/* Return the ids of the player and event names that contain TEXT.  */
+std::vector<unsigned> GameDB_Data::names_containing (const QString &text) const
+{
+	std::vector<unsigned> result;
+	if (text.length () < 3) {
+		for (auto id: m_name_ids)
+			if (m_strings[id].contains (text))
+				result.push_back (id);
+		return result;
+	}
+
+	std::vector<const std::vector<unsigned> *> lists;
+	for (int i = 0; i + 3 <= text.length (); i++) {
+		auto it = m_trigrams.find (trigram_key (text, i));
+		if (it == m_trigrams.end ())
+			return result;
+		lists.push_back (&it->second);
+	}
+	/* Start with the shortest list to keep the intersections small.  */
+	std::sort (std::begin (lists), std::end (lists),
+		   [] (const std::vector<unsigned> *a, const std::vector<unsigned> *b) { return a->size () < b->size (); });
+	std::vector<unsigned> cands = *lists[0];
+	std::vector<unsigned> tmp;
+	for (size_t i = 1; i < lists.size () && !cands.empty (); i++) {
+		tmp.clear ();
+		std::set_intersection (std::begin (cands), std::end (cands), std::begin (*lists[i]), std::end (*lists[i]),
+				       std::back_inserter (tmp));
+		cands.swap (tmp);
+	}
+	/* Containing all the trigrams does not mean containing them in the
+	   right order, so check the candidates.  */
+	for (auto id: cands)
+		if (m_strings[id].contains (text))
+			result.push_back (id);
+	return result;
+}
+
 void GameDB_Data::do_load (unsigned max_mb, bool cache_movelist)
 {
 	QMutexLocker lock (&db_mutex);
 	m_all_entries.clear ();
+	m_db_files.clear ();
+	m_strings.clear ();
+	m_string_ids.clear ();
+	m_finalpos.clear ();
+	m_finalpos_valid = false;
+	m_trigrams.clear ();
+	m_name_ids.clear ();
+	m_name_games_start.clear ();
+	m_name_games.clear ();
+	m_date_order.clear ();
+	m_date_rank.clear ();
+	/* Makes sure the empty string has index 0.  */
+	intern ("");
+
+	QElapsedTimer timer;
+	timer.start ();
+
+	/* The q5go.db files are independent of each other, so read them all at
+	   once.  Kombilo databases share a single SQLite connection and are read
+	   one after the other below.  */
+	std::vector<db_segment> segments (dbpaths.size ());
+	QThreadPool pool;
+	for (int i = 0; i < dbpaths.size (); i++) {
+		QDir dbdir (dbpaths[i]);
+		if (dbdir.exists ("q5go.db")) {
+			segments[i].queued = true;
+			pool.start (new DBLoadJob (dbdir, segments[i], max_mb));
+		}
+	}
+	pool.waitForDone ();
 
 	QSqlDatabase db = QSqlDatabase::database ("kombilo");
 
-	/* Assign all games unique IDs, combining the stored ID with the current total.  */
+	/* Assign all games unique IDs, combining the stored ID with the current total.
+	   Merging the segments in the order of the paths keeps both the IDs and
+	   the string indices the same as if the directories were read in turn.  */
 	int base_id = 0;
-	for (auto &it: dbpaths) {
+	for (int i = 0; i < dbpaths.size (); i++) {
+		const QString &it = dbpaths[i];
 		QDir dbdir (it);
-		if (dbdir.exists ("q5go.db")) {
-			size_t sz = m_all_entries.size ();
-			try {
-				read_q5go_db (dbdir, base_id, max_mb, cache_movelist);
-				base_id += m_all_entries.size () - sz;
-			} catch (db_errors_found &) {
-				m_all_entries.erase (m_all_entries.begin () + sz, m_all_entries.end ());
+		db_segment &seg = segments[i];
+		if (seg.queued) {
+			if (seg.errors_found)
 				errors_found = true;
-			} catch (db_too_large &) {
-				m_all_entries.erase (m_all_entries.begin () + sz, m_all_entries.end ());
+			else if (seg.too_large)
 				too_large = true;
+			else {
+				add_segment (seg, base_id);
+				base_id += seg.entries.size ();
 			}
+			qDebug () << it << ": read " << seg.entries.size () << " games in " << seg.msecs << " ms";
+			seg = db_segment ();
 			continue;
 		}
 
@@ -727,9 +1707,11 @@ void GameDB_Data::do_load (unsigned max_mb, bool cache_movelist)
 			this_max = std::max (this_max, id);
 			id += base_id;
 
-			m_all_entries.emplace_back (id, it, filename, q2.value (1).toString (), "",
-						    q2.value (2).toString (), "",
-						    date, q2.value (4).toString (), q2.value (5).toString (),
+			m_all_entries.emplace_back (id, intern (it), intern (filename),
+						    intern (q2.value (1).toString ()), 0,
+						    intern (q2.value (2).toString ()), 0,
+						    intern (date), intern (q2.value (4).toString ()),
+						    intern (q2.value (5).toString ()),
 						    boardsize, boardsize);
 		}
 		db.close ();
@@ -753,6 +1735,11 @@ void GameDB_Data::do_load (unsigned max_mb, bool cache_movelist)
 #endif
 		base_id += this_max + 1;
 	}
+	/* Only needed while loading.  */
+	m_string_ids.clear ();
+	build_date_index ();
+	build_name_index ();
+	qDebug () << "loaded " << m_all_entries.size () << " games in " << timer.elapsed () << " ms";
 
 	load_complete = true;
 	std::atomic_thread_fence (std::memory_order_seq_cst);
@@ -796,7 +1783,7 @@ QVariant gamedb_model::data (const QModelIndex &index, int role) const
 	if (row < 0 || (size_t)row >= m_entries.size () || role != Qt::DisplayRole || col != 0)
 		return QVariant ();
 	const gamedb_entry &e = find (row);
-	return e.pw + " - " + e.pb + ", " + e.result + ", " + e.date;
+	return db_data->str (e.pw) + " - " + db_data->str (e.pb) + ", " + db_data->str (e.result) + ", " + db_data->str (e.date);
 }
 
 QModelIndex gamedb_model::index (int row, int col, const QModelIndex &) const
@@ -857,15 +1844,25 @@ void gamedb_model::slot_load_complete ()
 	reset_filters ();
 }
 
+/* Sort the entries by date, newest first, using the order computed when
+   loading.  Filtering relies on the entries staying in this order.  */
 void gamedb_model::default_sort ()
 {
-	std::sort (std::begin (m_entries), std::end (m_entries),
-		   [] (unsigned a, unsigned b)
-		   {
-			   const gamedb_entry &e1 = db_data->m_all_entries[a];
-			   const gamedb_entry &e2 = db_data->m_all_entries[b];
-			   return e1.date > e2.date;
-		   });
+	const std::vector<unsigned> &order = db_data->m_date_order;
+	const std::vector<unsigned> &rank = db_data->m_date_rank;
+	/* Walking the whole order is cheaper than sorting, unless the list is short.  */
+	if (m_entries.size () < order.size () / 16) {
+		std::sort (std::begin (m_entries), std::end (m_entries),
+			   [&rank] (unsigned a, unsigned b) { return rank[a] < rank[b]; });
+		return;
+	}
+	std::vector<char> present (order.size ());
+	for (auto idx: m_entries)
+		present[idx] = 1;
+	m_entries.clear ();
+	for (auto idx: order)
+		if (present[idx])
+			m_entries.push_back (idx);
 }
 
 void gamedb_model::reset_filters ()
@@ -873,11 +1870,9 @@ void gamedb_model::reset_filters ()
 	beginResetModel ();
 	m_entries.clear ();
 	m_entries.reserve (db_data->m_all_entries.size ());
-	for (size_t i = 0; i < db_data->m_all_entries.size (); i++)
-		if (db_data->m_all_entries[i].movelist_off != 0 || !m_patternsearch)
-			m_entries.push_back (i);
-
-	default_sort ();
+	for (auto idx: db_data->m_date_order)
+		if (db_data->m_all_entries[idx].movelist_off != 0 || !m_patternsearch)
+			m_entries.push_back (idx);
 
 	endResetModel ();
 	emit signal_changed ();
@@ -900,26 +1895,102 @@ void gamedb_model::apply_game_list (std::vector<unsigned> &&games)
 void gamedb_model::apply_filter (const QString &p1, const QString &p2, const QString &event,
 				 const QString &dtfrom, const QString &dtto)
 {
-	beginResetModel ();
-	m_entries.erase (std::remove_if (std::begin (m_entries), std::end (m_entries),
-					 [&](unsigned idx)
-					 {
-						 const gamedb_entry &e = db_data->m_all_entries[idx];
-						 if (!p1.isEmpty () && !e.pw.contains (p1) && !e.pb.contains (p1))
-							 return true;
-						 if (!p2.isEmpty () && !e.pw.contains (p2) && !e.pb.contains (p2))
-							 return true;
-						 if (!dtfrom.isEmpty () && e.date < dtfrom)
-							 return true;
-						 if (!dtto.isEmpty () && e.date > dtto)
-							 return true;
+	const std::vector<gamedb_entry> &all = db_data->m_all_entries;
+	const std::vector<unsigned> &order = db_data->m_date_order;
+	const std::vector<unsigned> &rank = db_data->m_date_rank;
+	auto by_rank = [&rank] (unsigned idx, unsigned r) { return rank[idx] < r; };
+
+	/* Both the date order and our entries are sorted by date, so a date
+	   range is a slice of each, found by binary search.  */
+	unsigned from = dtfrom.isEmpty () ? 0 : date_re::bound (dtfrom, false);
+	unsigned to = dtto.isEmpty () ? date_re::max_key : date_re::bound (dtto, true);
+	unsigned first_rank = std::partition_point (std::begin (order), std::end (order),
+						    [&all, to] (unsigned idx) { return all[idx].date_key > to; }) - std::begin (order);
+	unsigned end_rank = std::partition_point (std::begin (order), std::end (order),
+						  [&all, from] (unsigned idx) { return all[idx].date_key >= from; }) - std::begin (order);
+	end_rank = std::max (first_rank, end_rank);
+	auto ebeg = std::lower_bound (std::begin (m_entries), std::end (m_entries), first_rank, by_rank);
+	auto eend = std::lower_bound (ebeg, std::end (m_entries), end_rank, by_rank);
+
+	/* The names are looked up in the trigram index, which yields the ids of
+	   all matching strings at once.  */
+	struct name_filter
+	{
+		std::vector<unsigned> ids;
+		std::vector<char> match;
+		size_t n_games = 0;
+	};
+	auto make_filter = [] (const QString &text)
+	{
+		name_filter f;
+		if (text.isEmpty ())
+			return f;
+		f.ids = db_data->names_containing (text);
+		f.match.resize (db_data->m_strings.size ());
+		for (auto id: f.ids) {
+			f.match[id] = 1;
+			f.n_games += db_data->m_name_games_start[id + 1] - db_data->m_name_games_start[id];
+		}
+		return f;
+	};
+	name_filter match_p1 = make_filter (p1);
+	name_filter match_p2 = make_filter (p2);
+	name_filter match_ev = make_filter (event);
+	auto passes = [&] (const gamedb_entry &e)
+	{
+		if (!p1.isEmpty () && !match_p1.match[e.pw] && !match_p1.match[e.pb])
+			return false;
+		if (!p2.isEmpty () && !match_p2.match[e.pw] && !match_p2.match[e.pb])
+			return false;
 #if 1
-						 if (!event.isEmpty () && !e.event.contains (event) && !e.pb.contains (event))
-							 return true;
+		if (!event.isEmpty () && !match_ev.match[e.event] && !match_ev.match[e.pb])
+			return false;
 #endif
-						 return false;
-					 }),
-			 std::end (m_entries));
+		return true;
+	};
+
+	const name_filter *narrowest = nullptr;
+	if (!p1.isEmpty ())
+		narrowest = &match_p1;
+	if (!p2.isEmpty () && (narrowest == nullptr || match_p2.n_games < narrowest->n_games))
+		narrowest = &match_p2;
+	if (!event.isEmpty () && (narrowest == nullptr || match_ev.n_games < narrowest->n_games))
+		narrowest = &match_ev;
+
+	std::vector<unsigned> result;
+	if (narrowest == nullptr || narrowest->n_games >= (size_t)(eend - ebeg)) {
+		for (auto it = ebeg; it != eend; ++it)
+			if (passes (all[*it]))
+				result.push_back (*it);
+	} else {
+		/* Collect the games within the date range that use one of the names
+		   of the narrowest filter, and look for them in our entries.  */
+		std::vector<unsigned> cands;
+		const std::vector<unsigned> &games = db_data->m_name_games;
+		for (auto id: narrowest->ids) {
+			auto gbeg = std::begin (games) + db_data->m_name_games_start[id];
+			auto gend = std::begin (games) + db_data->m_name_games_start[id + 1];
+			gbeg = std::lower_bound (gbeg, gend, first_rank);
+			gend = std::lower_bound (gbeg, gend, end_rank);
+			cands.insert (std::end (cands), gbeg, gend);
+		}
+		std::sort (std::begin (cands), std::end (cands));
+		cands.erase (std::unique (std::begin (cands), std::end (cands)), std::end (cands));
+		auto pos = ebeg;
+		for (auto r: cands) {
+			unsigned idx = order[r];
+			if (!passes (all[idx]))
+				continue;
+			pos = std::lower_bound (pos, eend, r, by_rank);
+			if (pos == eend)
+				break;
+			if (*pos == idx)
+				result.push_back (idx);
+		}
+	}
+
+	beginResetModel ();
+	m_entries = std::move (result);
 	endResetModel ();
 	emit signal_changed ();
 }
@@ -4,44 +4,100 @@
 #include <QAbstractItemModel>
 #include <QMutex>
 #include <QString>
+#include <QHash>
 #include <vector>
 #include <atomic>
 #include <array>
+#include <memory>
+#include <unordered_map>
+#include <functional>
 
 #include "bitarray.h"
 #include "coords.h"
 
 class go_pattern;
+class game_record;
+typedef std::shared_ptr<game_record> go_game_ptr;
 
+/* The strings of an entry are indices into the string table of GameDB_Data;
+   use db_data->str () to look them up.  */
 struct gamedb_entry
 {
-	QString dirname, filename;
-	QString pw, rkw, pb, rkb;
-	QString date, result, event;
+	unsigned dirname, filename;
+	unsigned pw, rkw, pb, rkb;
+	unsigned date, result, event;
 	std::vector<char> movelist;
 	int id;
 	int sz_x, sz_y;
 	bit_array finalpos_w, finalpos_b, finalpos_c;
+	/* Version 5 files keep the captures bitmap packed; if this is set, it
+	   is found here and FINALPOS_C is unused.  See final_caps.  */
+	const char *finalpos_c_map = nullptr;
+	uint16_t finalpos_c_len = 0;
 	/* Shifted by 1, the lowest bit indicates whether it's in the q5go.db file.  */
 	size_t movelist_off = 0;
+	/* Index of the game within its file, for collections of several games.  */
+	unsigned game_idx = 0;
+	/* The movelist inside a mapped q5go.db file, if there is one.  */
+	const char *movelist_map = nullptr;
+	uint32_t movelist_len = 0;
+	/* Whether the movelist uses the packed encoding of movelist_decoder.  */
+	bool movelist_packed = false;
+	/* The date packed as YYYYMMDD, with zero for unknown parts.  */
+	unsigned date_key = 0;
 
-	gamedb_entry (int i, const QString &dir, const QString &f,
-		      const QString &w, const QString &rw, const QString &b, const QString &rb,
-		      const QString &d, const QString &r, const QString &e, int sx, int sy)
+	gamedb_entry (int i, unsigned dir, unsigned f, unsigned w, unsigned rw, unsigned b, unsigned rb,
+		      unsigned d, unsigned r, unsigned e, int sx, int sy)
 		: dirname (dir), filename (f), pw (w), rkw (rw), pb (b), rkb (rb), date (d), result (r), event (e),
 		  id (i), sz_x (sx), sz_y (sy), finalpos_w (sx * sy), finalpos_b (sx * sy), finalpos_c (sx * sy)
 	{
 	}
+	/* Refer to the three final position bitmaps stored one after the other
+	   at BITS, in a mapped q5go.db file.  */
+	gamedb_entry (int i, unsigned dir, unsigned f, unsigned w, unsigned rw, unsigned b, unsigned rb,
+		      unsigned d, unsigned r, unsigned e, int sx, int sy, const uint64_t *bits)
+		: dirname (dir), filename (f), pw (w), rkw (rw), pb (b), rkb (rb), date (d), result (r), event (e),
+		  id (i), sz_x (sx), sz_y (sy), finalpos_w (bits, sx * sy),
+		  finalpos_b (bits + (sx * sy + 63) / 64, sx * sy),
+		  finalpos_c (bits + 2 * ((sx * sy + 63) / 64), sx * sy)
+	{
+	}
+	/* Refer to the white and black bitmaps stored one after the other at
+	   BITS, and to the packed captures bitmap at CAPS, in a mapped q5go.db
+	   file of version 5.  */
+	gamedb_entry (int i, unsigned dir, unsigned f, unsigned w, unsigned rw, unsigned b, unsigned rb,
+		      unsigned d, unsigned r, unsigned e, int sx, int sy, const uint64_t *bits,
+		      const char *caps, uint16_t caps_len)
+		: dirname (dir), filename (f), pw (w), rkw (rw), pb (b), rkb (rb), date (d), result (r), event (e),
+		  id (i), sz_x (sx), sz_y (sy), finalpos_w (bits, sx * sy),
+		  finalpos_b (bits + (sx * sy + 63) / 64, sx * sy),
+		  finalpos_c (nullptr, 0), finalpos_c_map (caps), finalpos_c_len (caps_len)
+	{
+	}
 	gamedb_entry (const gamedb_entry &other) = default;
 	gamedb_entry (gamedb_entry &&other) = default;
 	gamedb_entry &operator =(gamedb_entry &&other) = default;
 	gamedb_entry &operator =(const gamedb_entry &other) = default;
+
+	const bit_array &final_caps (bit_array &scratch) const;
+};
+
+/* The final positions of all games of one board size, stored by columns:
+   element E of the bitmaps of game I is at E * games.size () + I.  This lets
+   the first phase of a pattern search test many games at once.  */
+struct finalpos_store
+{
+	unsigned sz_x, sz_y, n_elts;
+	/* Indices into m_all_entries.  */
+	std::vector<unsigned> games;
+	std::vector<uint64_t> w, b;
 };
 
 class gamedb_model : public QAbstractItemModel
 {
 	Q_OBJECT
 
+	/* Always kept sorted by date, in the order of db_data->m_date_order.  */
 	std::vector<unsigned> m_entries;
 	bool m_patternsearch;
 
@@ -57,6 +113,7 @@ public:
 	using search_result = std::pair<std::vector<std::array<int, 2>>, std::vector<cont_bw>>;
 	search_result find_pattern (const go_pattern &, std::atomic<long> *, std::atomic<long> *);
 	const gamedb_entry &find (size_t) const;
+	const std::vector<unsigned> &entries () const { return m_entries; }
 	QString status_string () const;
 
 	virtual QVariant data (const QModelIndex &index, int role = Qt::DisplayRole) const override;
@@ -90,13 +147,30 @@ signals:
 };
 
 class QDir;
+class db_file_data;
+struct db_segment;
 class GameDB_Data : public QObject
 {
 	Q_OBJECT
 
+	/* Maps strings to their index in M_STRINGS while loading.  */
+	QHash<QString, unsigned> m_string_ids;
+	/* Built on demand by finalpos_stores.  */
+	std::vector<finalpos_store> m_finalpos;
+	bool m_finalpos_valid = false;
+	QMutex m_finalpos_mutex;
+	/* Maps each trigram of the player and event names to the sorted ids of
+	   the strings containing it.  Built by build_name_index after loading.  */
+	std::unordered_map<uint64_t, std::vector<unsigned>> m_trigrams;
+	/* The ids of all player and event names, for queries too short to use
+	   the trigram index.  */
+	std::vector<unsigned> m_name_ids;
+
 	void do_load (unsigned, bool);
+	void build_date_index ();
+	void build_name_index ();
 	bool read_extra_file (QDataStream &, int, int, unsigned, bool);
-	bool read_q5go_db (const QDir &, int, unsigned, bool);
+	void add_segment (db_segment &, int);
 
 public:
 	/* A local copy of the paths in settings.  */
@@ -104,12 +178,30 @@ public:
 	/* Computed in slot_start_load.  Once completed, we signal_load_complete,
 	   after which only the main thread can access this vector.  */
 	std::vector<gamedb_entry> m_all_entries;
+	/* The strings referred to by the entries.  Each one is stored only once.  */
+	std::vector<QString> m_strings;
+	/* The q5go.db files that the entries refer to.  */
+	std::vector<std::shared_ptr<const db_file_data>> m_db_files;
+	/* The indices of all entries sorted by date, newest first, and the
+	   position of each entry in that order, its rank.  */
+	std::vector<unsigned> m_date_order;
+	std::vector<unsigned> m_date_rank;
+	/* The ranks of the games using each string as a player or event name,
+	   in ascending order.  Those of string I are found in M_NAME_GAMES
+	   between M_NAME_GAMES_START[I] and M_NAME_GAMES_START[I + 1].  */
+	std::vector<unsigned> m_name_games_start;
+	std::vector<unsigned> m_name_games;
 	QMutex db_mutex;
 	bool load_complete = false;
 	bool too_large = false;
 	bool errors_found = false;
 	bool errors_kombilo = false;
 
+	unsigned intern (const QString &);
+	const QString &str (unsigned id) const { return m_strings[id]; }
+	const std::vector<finalpos_store> &finalpos_stores ();
+	std::vector<unsigned> names_containing (const QString &) const;
+
 public slots:
 	void slot_start_load (unsigned, bool);
 signals:
@@ -129,7 +221,170 @@ static const int db_mv_flag_endvar = 32;
 static const int db_mv_flag_branch = 64;
 static const int db_mv_flag_node_end = 128;
 
+/* Reads the bit streams of version 5 q5go.db files, least significant bit
+   first.  Reading past the end yields zeros and sets a flag.  */
+class db_bit_reader
+{
+	const unsigned char *m_p, *m_end;
+	uint64_t m_bits = 0;
+	unsigned m_n_bits = 0;
+	bool m_overrun = false;
+
+public:
+	db_bit_reader (const char *p, size_t len)
+		: m_p ((const unsigned char *)p), m_end ((const unsigned char *)p + len)
+	{
+	}
+	bool overrun () const { return m_overrun; }
+	/* Return the next N bits, at most 32, without consuming them.  Bits
+	   past the end read as zero.  */
+	uint32_t peek (unsigned n)
+	{
+		while (m_n_bits <= 56 && m_p != m_end) {
+			m_bits |= (uint64_t)*m_p++ << m_n_bits;
+			m_n_bits += 8;
+		}
+		return m_bits & (((uint64_t)1 << n) - 1);
+	}
+	void skip (unsigned n)
+	{
+		if (m_n_bits < n) {
+			m_overrun = true;
+			m_bits = 0;
+			m_n_bits = 0;
+			return;
+		}
+		m_bits >>= n;
+		m_n_bits -= n;
+	}
+	/* Read N bits, at most 32.  */
+	uint32_t get (unsigned n)
+	{
+		uint32_t v = peek (n);
+		skip (n);
+		return v;
+	}
+	/* Read a number of at least 1 in Elias gamma code.  */
+	uint32_t get_gamma ()
+	{
+		unsigned zeros = 0;
+		while (get (1) == 0) {
+			if (m_overrun || ++zeros > 31) {
+				m_overrun = true;
+				return 1;
+			}
+		}
+		return ((uint32_t)1 << zeros) | get (zeros);
+	}
+};
+
+/* Produces the tokens of a movelist, two bytes each as described by the
+   flags above, from either the plain encoding, which simply stores them, or
+   the packed one of version 5 q5go.db files.  The latter is a bit stream
+   that starts with the number of tokens plus one, in gamma code, followed by
+   the tokens:
+     0 P        a stone of the expected color on point P, ending the node
+     10 P       a stone of the other color on point P, ending the node
+     110 C D E P  any other change of point P; black if C, removed if D,
+                ending the node if E
+     1110       a branch
+     11110      the end of a variation
+     11111      an empty node
+   Points are numbered row by row, using as few bits as the board size
+   allows.  The expected color is black at first, then the opposite of the
+   last stone added.  Decoding stops at the end of the data, so it can be
+   done while matching.  */
+class movelist_decoder
+{
+	const char *m_p, *m_end;
+	bool m_packed;
+	db_bit_reader m_reader;
+	int m_sz_x;
+	unsigned m_point_bits = 1;
+	uint32_t m_left = 0;
+	int m_expected = db_mv_flag_black;
+
+public:
+	movelist_decoder (const char *p, size_t len, bool packed, int sz_x, int sz_y)
+		: m_p (p), m_end (p + len), m_packed (packed), m_reader (p, len), m_sz_x (sz_x)
+	{
+		if (!packed || sz_x <= 0 || sz_y <= 0)
+			return;
+		while ((1 << m_point_bits) < sz_x * sz_y)
+			m_point_bits++;
+		m_left = m_reader.get_gamma () - 1;
+	}
+	bool next (int &x, int &y)
+	{
+		if (!m_packed) {
+			if (m_end - m_p < 2)
+				return false;
+			x = m_p[0];
+			y = m_p[1];
+			m_p += 2;
+			return true;
+		}
+		if (m_left == 0)
+			return false;
+		m_left--;
+		int col = m_expected;
+		int del = 0;
+		bool end = true;
+		/* Look at the longest possible token at once.  */
+		uint32_t code = m_reader.peek (6 + m_point_bits);
+		uint32_t mask = (1 << m_point_bits) - 1;
+		unsigned p;
+		if ((code & 1) == 0) {
+			p = (code >> 1) & mask;
+			m_reader.skip (1 + m_point_bits);
+		} else if ((code & 2) == 0) {
+			col ^= db_mv_flag_black | db_mv_flag_white;
+			p = (code >> 2) & mask;
+			m_reader.skip (2 + m_point_bits);
+		} else if ((code & 4) == 0) {
+			col = code & 8 ? db_mv_flag_black : db_mv_flag_white;
+			del = code & 16 ? db_mv_flag_delete : 0;
+			end = (code & 32) != 0;
+			p = (code >> 6) & mask;
+			m_reader.skip (6 + m_point_bits);
+		} else {
+			if ((code & 8) == 0) {
+				x = db_mv_flag_branch;
+				m_reader.skip (4);
+			} else {
+				x = code & 16 ? (signed char)db_mv_flag_node_end : db_mv_flag_endvar;
+				m_reader.skip (5);
+			}
+			y = 0;
+			return !m_reader.overrun ();
+		}
+		if (del == 0)
+			m_expected = col ^ (db_mv_flag_black | db_mv_flag_white);
+		x = (signed char)(p % m_sz_x | (end ? db_mv_flag_node_end : 0));
+		y = (signed char)(p / m_sz_x | col | del);
+		return !m_reader.overrun ();
+	}
+};
+
+/* Called while a database is built, with the number of files parsed so far
+   and the number to parse.  Returning false cancels the build.  */
+typedef std::function<bool (int, int)> db_build_progress;
+
+struct db_build_stats
+{
+	/* The SGF files found, the ones parsed, and those that could not be read
+	   or held games that could not be parsed.  */
+	int n_files = 0, n_parsed = 0, n_failed = 0;
+	size_t n_games = 0;
+	/* Set if the database was up to date and not written again.  */
+	bool unchanged = false;
+};
+
+extern bool build_db_for_dir (const QString &dir, bool update, int n_jobs,
+			      const db_build_progress &, db_build_stats &);
+
 extern bit_array match_games (const std::vector<unsigned> &, const go_pattern &,
 			      std::vector<gamedb_model::cont_bw> &conts, coord_transform);
+extern go_game_ptr build_opening_tree (const std::vector<unsigned> &, int n_moves, int min_games);
 
 #endif
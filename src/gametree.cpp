@@ -75,6 +75,10 @@ void GameTreePixmap::paint (QPainter *painter, const QStyleOptionGraphicsItem *,
 	painter->setPen (Qt::NoPen);
 	QPen diag_pen (Qt::blue);
 	diag_pen.setWidth (2);
+	QPen transpos_pen (Qt::darkGreen);
+	transpos_pen.setWidth (2);
+	QPen pending_pen (Qt::darkGray);
+	pending_pen.setWidth (2);
 
 	while (st != nullptr) {
 		game_tree_pixmaps *pm = st->comment ().empty () ? m_pm : m_pm_comment;
@@ -94,6 +98,21 @@ void GameTreePixmap::paint (QPainter *painter, const QStyleOptionGraphicsItem *,
 					  m_size / 2 - 4, m_size / 2 - 4);
 			painter->setPen (Qt::NoPen);
 		}
+		if (setting->values.gametree_transpos && st->transposition_p ()) {
+			painter->setPen (transpos_pen);
+			painter->drawEllipse (x * m_size + 3, m_size / 2 + 2,
+					      m_size / 2 - 5, m_size / 2 - 5);
+			painter->setPen (Qt::NoPen);
+		}
+		if (st->has_pending_variations ()) {
+			int cx = x * m_size + m_size * 3 / 4;
+			int cy = m_size * 3 / 4;
+			int r = m_size / 8;
+			painter->setPen (pending_pen);
+			painter->drawLine (cx - r, cy, cx + r, cy);
+			painter->drawLine (cx, cy - r, cx, cy + r);
+			painter->setPen (Qt::NoPen);
+		}
 #if 0
 		if (!st->comment ().empty ()) {
 			QPen circle_pen (diag_pen);
@@ -168,7 +187,8 @@ GameTree::GameTree (QWidget *parent)
 	setDragMode (QGraphicsView::ScrollHandDrag);
 	setToolTip (tr ("The game tree.\nClick nodes to move to them, click empty areas to drag.\n"
 			"Shift-click or middle-click nodes to collapse or expand their sub-variations.\n"
-			"Control-click a collapsed node to expand one level of its children."));
+			"Control-click a collapsed node to expand one level of its children.\n"
+			"A small cross marks nodes with variations that are not loaded yet; shift-click to load them."));
 
 	update_prefs ();
 
@@ -296,7 +316,11 @@ QSize GameTree::sizeHint () const
 
 void GameTree::toggle_collapse (game_state *st, bool one_level)
 {
-	if (one_level) {
+	if (st->has_pending_variations () && !st->vis_collapsed ()) {
+		/* Counting the children converts the pending variations, which makes
+		   them part of the visualization.  */
+		st->n_children ();
+	} else if (one_level) {
 		if (!st->vis_expand_one ())
 			return;
 	} else
@@ -329,7 +353,9 @@ void GameTree::show_menu (game_state *st, const QPoint &pos)
 	if (st->vis_collapsed ()) {
 		menu.addAction (QIcon (m_box_pm), QObject::tr ("Expand subtree"), [=] () { toggle_collapse (st, false); });
 		menu.addAction (QObject::tr ("Expand one level of child nodes"), [=] () { toggle_collapse (st, true); });
-	} else
+	} else if (st->has_pending_variations ())
+		menu.addAction (QIcon (m_box_pm), QObject::tr ("Load remaining variations"), [=] () { toggle_collapse (st, false); });
+	else
 		menu.addAction (QIcon (m_box_pm), QObject::tr ("Collapse subtree"), [=] () { toggle_collapse (st, false); });
 	if (st->has_figure ())
 		menu.addAction (QIcon (":/BoardWindow/images/boardwindow/figure.png"),
@@ -405,7 +405,7 @@ public:
 	}
 	go_score get_scores () const;
 	void territory_from_markers ();
-	void append_marks_sgf (std::string &) const;
+	void append_marks_sgf (sgf_writer &) const;
 
 private:
 	void recalc_liberties ();
@@ -446,7 +446,7 @@ private:
 				tmp.set_bit (i);
 		return tmp;
 	}
-	void append_mark_plane_sgf (std::string &, const std::string &, const bit_array &) const;
+	void append_mark_plane_sgf (sgf_writer &, const std::string &, const bit_array &) const;
 	void verify_invariants ();
 };
 
@@ -1,6 +1,9 @@
 #ifndef GOEVAL_H
 #define GOEVAL_H
 
+#include <cstdint>
+#include <string>
+
 struct analyzer_id {
 	std::string engine;
 	double komi = 0;
@@ -25,4 +28,14 @@ struct eval {
 	analyzer_id id;
 };
 
+/* The form in which evaluations are kept in game nodes.  The analyzer is an index
+   into the table of analyzer_ids held by the game_state_manager.  */
+struct stored_eval {
+	double score_mean;
+	double score_stddev;
+	double wr_black;
+	int visits;
+	uint16_t id;
+};
+
 #endif
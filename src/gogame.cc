@@ -1,3 +1,10 @@
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+
+#include <atomic>
+#include <unordered_map>
+
 #include "goboard.h"
 #include "gogame.h"
 #include "svgbuilder.h"
@@ -29,6 +36,8 @@ void game_state_manager::release_game_state (game_state *st)
 	st->disconnect ();
 	while (st != nullptr) {
 		game_state *next = nullptr;
+		/* No point in converting variations only to free them.  */
+		st->m_pending = nullptr;
 		auto &cld = st->children ();
 		if (cld.size () > 0) {
 			for (auto c: cld)
@@ -50,11 +59,59 @@ void game_state_manager::release_game_state (game_state *st)
 
 void game_state_manager::release_state_children (game_state *st)
 {
+	st->m_pending = nullptr;
 	for (auto c: st->children ()) {
 		release_game_state (c);
 	}
 }
 
+void game_state_manager::reserve (size_t n)
+{
+	size_t n_chunks = (n + m_n_per_chunk - 1) / m_n_per_chunk;
+	if (n_chunks <= m_game_states.size ())
+		return;
+	m_game_states.reserve (n_chunks);
+	while (m_game_states.size () < n_chunks)
+		m_game_states.push_back (new char[sizeof (game_state) * m_n_per_chunk]);
+	m_free.grow (n_chunks * m_n_per_chunk);
+}
+
+game_state *game_state_manager::resolve (const node_ref &r) const
+{
+	game_state *st = find_by_id (r.id);
+	if (st == nullptr || st->m_serial != r.serial)
+		return nullptr;
+	return st;
+}
+
+void game_state::copy_from (const game_state &other, bool same_ids)
+{
+	other.expand ();
+	for (auto c: other.m_children) {
+		game_state *new_c;
+		if (same_ids)
+			new_c = m_manager->create_game_state_at (c->m_id, *c, this, game_state::same_ids);
+		else
+			new_c = m_manager->create_game_state (*c, this);
+		m_children.push_back (new_c);
+	}
+	m_comment = other.m_comment;
+	m_active = other.m_active;
+	m_figure = other.m_figure;
+	m_print_numbering = other.m_print_numbering;
+	/* Transposition links are not copied; game_record redoes the search for copies.  */
+	if (other.m_manager == m_manager)
+		m_evals = other.m_evals;
+	else
+		for (const auto &it: other.m_evals)
+			m_evals.push_back (pack_eval (other.unpack_eval (it)));
+
+	m_timeleft_w = other.m_timeleft_w;
+	m_timeleft_b = other.m_timeleft_b;
+	m_stonesleft_w = other.m_stonesleft_w;
+	m_stonesleft_b = other.m_stonesleft_b;
+}
+
 
 bool game_state::valid_move_p (int x, int y, stone_color col)
 {
@@ -63,6 +120,7 @@ bool game_state::valid_move_p (int x, int y, stone_color col)
 
 void game_state::make_child_primary (const game_state *st)
 {
+	expand ();
 	auto beg = std::begin (m_children);
 	auto end = std::end (m_children);
 	auto it = std::find (beg, end, st);
@@ -79,6 +137,7 @@ const go_board game_state::child_moves (const game_state *excluding, bool exclud
 {
 	go_board b (m_board.size_x (), m_board.size_y ());
 	size_t n = 0;
+	expand ();
 	for (const auto &it: m_children) {
 		if (it == excluding || (it->has_figure () && exclude_figs))
 			continue;
@@ -308,6 +367,7 @@ bool game_state::vis_expand_one ()
 {
 	if (!m_visual_collapse)
 		return false;
+	expand ();
 	toggle_vis_collapse ();
 	for (auto it: m_children)
 		if (!it->m_visual_collapse)
@@ -356,7 +416,7 @@ bool game_state::has_figure_recursive () const
 {
 	const game_state *st = this;
 	for (;;) {
-		if (st->has_figure ())
+		if (st->has_figure () || st->pending_has_figure ())
 			return true;
 		if (st->m_children.size () == 0)
 			return false;
@@ -371,7 +431,48 @@ bool game_state::has_figure_recursive () const
 	return false;
 }
 
-void game_state::update_eval (const eval &ev)
+uint16_t game_state_manager::intern_analyzer (const analyzer_id &id)
+{
+	int idx = find_analyzer (id);
+	if (idx >= 0)
+		return idx;
+	if (m_analyzers.size () > UINT16_MAX)
+		throw std::length_error ("too many analyzers");
+	m_analyzers.push_back (id);
+	return m_analyzers.size () - 1;
+}
+
+int game_state_manager::find_analyzer (const analyzer_id &id) const
+{
+	for (size_t i = 0; i < m_analyzers.size (); i++)
+		if (m_analyzers[i] == id)
+			return i;
+	return -1;
+}
+
+eval game_state::unpack_eval (const stored_eval &se) const
+{
+	eval ev;
+	ev.visits = se.visits;
+	ev.score_mean = se.score_mean;
+	ev.score_stddev = se.score_stddev;
+	ev.wr_black = se.wr_black;
+	ev.id = m_manager->analyzer (se.id);
+	return ev;
+}
+
+stored_eval game_state::pack_eval (const eval &ev)
+{
+	stored_eval se;
+	se.visits = ev.visits;
+	se.score_mean = ev.score_mean;
+	se.score_stddev = ev.score_stddev;
+	se.wr_black = ev.wr_black;
+	se.id = m_manager->intern_analyzer (ev.id);
+	return se;
+}
+
+void game_state::update_stored_eval (const stored_eval &ev)
 {
 	for (auto &ours: m_evals) {
 		if (ev.id == ours.id) {
@@ -383,42 +484,102 @@ void game_state::update_eval (const eval &ev)
 	m_evals.push_back (ev);
 }
 
+void game_state::update_eval (const eval &ev)
+{
+	update_stored_eval (pack_eval (ev));
+}
+
 void game_state::update_eval (const game_state &other)
 {
+	if (&other == this)
+		return;
 	for (auto &it: other.m_evals)
-		update_eval (it);
+		if (other.m_manager == m_manager)
+			update_stored_eval (it);
+		else
+			update_eval (other.unpack_eval (it));
 }
 
 eval game_state::best_eval ()
 {
-	eval best;
-	for (const auto &it: m_evals) {
-		if ((it.id.komi_set && !best.id.komi_set) || it.visits > best.visits)
-			best = it;
-	}
-	return best;
+	const stored_eval *best = nullptr;
+	bool best_komi = false;
+	auto consider = [&] (const std::vector<stored_eval> &evals)
+		{
+			for (const auto &it: evals) {
+				bool komi_set = m_manager->analyzer (it.id).komi_set;
+				if ((komi_set && !best_komi) || it.visits > (best == nullptr ? 0 : best->visits)) {
+					best = &it;
+					best_komi = komi_set;
+				}
+			}
+		};
+	consider (m_evals);
+	const game_state *src = transposition_source ();
+	if (src != nullptr)
+		consider (src->m_evals);
+	return best == nullptr ? eval () : unpack_eval (*best);
 }
 
 eval game_state::eval_from (const analyzer_id &id, bool require)
 {
-	for (const auto &it: m_evals) {
-		if (it.id == id)
-			return it;
-	}
+	eval ev;
+	if (find_eval (id, ev))
+		return ev;
 	return require ? eval () : best_eval ();
 }
 
 void game_state::remove_eval (const analyzer_id &id)
 {
+	int idx = analyzer_index (id);
+	if (idx < 0)
+		return;
 	auto beg = m_evals.begin ();
 	auto end = m_evals.end ();
 	for (auto it = beg; it != end; ++it)
-		if (it->id == id) {
+		if (it->id == idx) {
 			m_evals.erase (it);
 			return;
 		}
 }
 
+const game_state *game_state::transposition_source () const
+{
+	if (!m_transposed_from.valid ())
+		return nullptr;
+	const game_state *st = m_manager->resolve (m_transposed_from);
+	if (st == nullptr || st == this || st->m_to_move != m_to_move || !st->m_board.position_equal_p (m_board))
+		return nullptr;
+	return st;
+}
+
+int game_state::ko_point () const
+{
+	if (!was_move_p () || m_parent == nullptr)
+		return -1;
+	bool is_b = m_move_color == black;
+	bit_array captured (is_b ? m_parent->m_board.get_stones_w () : m_parent->m_board.get_stones_b ());
+	captured.andnot (is_b ? m_board.get_stones_w () : m_board.get_stones_b ());
+	if (captured.popcnt () != 1)
+		return -1;
+
+	/* A ko exists if the new stone is alone and its only liberty is the point
+	   just captured.  */
+	int ko = captured.ffs ();
+	static const int offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+	for (auto &o: offsets) {
+		int x = m_move_x + o[0];
+		int y = m_move_y + o[1];
+		if (x < 0 || y < 0 || x >= m_board.size_x () || y >= m_board.size_y ())
+			continue;
+		if (m_board.bitpos (x, y) == ko)
+			continue;
+		if (m_board.stone_at (x, y) != (is_b ? white : black))
+			return -1;
+	}
+	return ko;
+}
+
 void game_state::walk_tree (const std::function<bool (game_state *)> &func)
 {
 	/* This function is slightly convoluted, in order to both
@@ -432,6 +593,7 @@ void game_state::walk_tree (const std::function<bool (game_state *)> &func)
 	}
 	game_state *st = this;
 	while (st != last) {
+		st->expand ();
 		for (auto &it: st->m_children)
 			if (it != st->m_children[0])
 				it->walk_tree (func);
@@ -439,60 +601,199 @@ void game_state::walk_tree (const std::function<bool (game_state *)> &func)
 	}
 }
 
-std::vector<int> game_state::path_from_root ()
+/* Split the tree into segments for parallel searching.  Each segment is a run of
+   at most max_segment_len nodes along a primary line.  Collecting them in the
+   following order and concatenating the results gives the walk_tree order.
+   An explicit stack is used rather than recursion, since review files can nest
+   variations very deeply.  Unlike walk_tree, this does not expand nodes, so
+   variations that have not been loaded yet are not searched.  */
+
+static const size_t max_segment_len = 64;
+
+void game_state::collect_segments (std::vector<tree_segment> &segs)
 {
-	std::vector<int> v;
-	game_state *st = this;
-	while (st->m_parent != nullptr) {
-		game_state *p = st->m_parent;
-		if (p->m_children.size () == 1) {
-			int len = 0;
-			while (p != nullptr && p->m_children.size () == 1) {
-				len++;
-				st = p;
-				p = p->m_parent;
+	std::vector<game_state *> stack { this };
+	std::vector<game_state *> variations;
+	while (!stack.empty ()) {
+		game_state *line = stack.back ();
+		stack.pop_back ();
+
+		game_state *start = line;
+		size_t len = 0;
+		for (game_state *st = line; st != nullptr; st = st->next_primary_move ()) {
+			if (len == max_segment_len) {
+				segs.emplace_back (start, len);
+				start = st;
+				len = 0;
 			}
-			v.push_back (len);
-			continue;
+			len++;
+			for (auto &it: st->m_children)
+				if (it != st->m_children[0])
+					variations.push_back (it);
 		}
-		for (size_t i = 0; i < p->m_children.size (); i++)
-			if (p->m_children[i] == st) {
-				v.push_back (i);
-				break;
-			}
-		st = p;
+		segs.emplace_back (start, len);
+
+		/* Pushed in reverse, so that the first variation is handled next.  */
+		stack.insert (stack.end (), variations.rbegin (), variations.rend ());
+		variations.clear ();
 	}
-	return v;
 }
 
-game_state *game_state::follow_path (const std::vector<int> &path)
+class TreeSearch : public QRunnable
 {
-	game_state *st = this;
-	for (size_t i = path.size (); i-- > 0;) {
-		int idx = path[i];
-		if (st->m_children.size () == 1) {
-			for (int j = 0; j < idx; j++) {
-				/* This case occurred twice, when using pattern search
-				   on an observed game.  The cause seems to have been
-				   a game record mismatch when resuming an adjourned
-				   game.
-				   Assumed fixed now, but we can leave this code
-				   here for safety.  */
-				if (st->n_children () != 1) {
-#ifdef CHECKING
-					abort ();
-#else
-					return st;
-#endif
+	const std::vector<std::pair<game_state *, size_t>> &m_segs;
+	std::vector<std::vector<game_state *>> &m_results;
+	const game_state::search_pred &m_pred;
+	/* For find_first: the lowest segment index that had a match so far.  */
+	std::atomic<size_t> *m_found;
+	QSemaphore *m_sem;
+	size_t m_first, m_end;
+
+public:
+	TreeSearch (const std::vector<std::pair<game_state *, size_t>> &segs, std::vector<std::vector<game_state *>> &r,
+		    const game_state::search_pred &pred, std::atomic<size_t> *found, QSemaphore *s,
+		    size_t first, size_t end)
+		: m_segs (segs), m_results (r), m_pred (pred), m_found (found), m_sem (s), m_first (first), m_end (end)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		for (size_t i = m_first; i < m_end; i++) {
+			/* Stop early if someone else already found an earlier match.  */
+			if (m_found != nullptr && m_found->load () < i)
+				break;
+			game_state *st = m_segs[i].first;
+			for (size_t n = 0; n < m_segs[i].second; n++, st = st->next_primary_move ()) {
+				if (!m_pred (st))
+					continue;
+				m_results[i].push_back (st);
+				if (m_found != nullptr) {
+					size_t old = m_found->load ();
+					while (i < old && !m_found->compare_exchange_weak (old, i))
+						;
+					break;
 				}
-				st = st->m_children[0];
 			}
+			if (m_found != nullptr && m_results[i].size () > 0)
+				break;
+		}
+		m_sem->release ();
+	}
+};
+
+std::vector<game_state *> game_state::parallel_search (const search_pred &pred, bool first_only)
+{
+	std::vector<tree_segment> segs;
+	collect_segments (segs);
+
+	size_t total = 0;
+	for (auto &it: segs)
+		total += it.second;
+
+	std::vector<std::vector<game_state *>> results (segs.size ());
+	std::atomic<size_t> found (segs.size ());
+	QSemaphore completion_sem (0);
+	QThreadPool *pool = QThreadPool::globalInstance ();
+	/* Aim for a few tasks per thread to even out the load.  */
+	size_t steps = std::max (max_segment_len, total / (4 * std::max (1, pool->maxThreadCount ())));
+	int n_started = 0;
+	size_t first = 0, count = 0;
+	for (size_t i = 0; i < segs.size (); i++) {
+		count += segs[i].second;
+		if (count < steps && i + 1 < segs.size ())
 			continue;
+		pool->start (new TreeSearch (segs, results, pred, first_only ? &found : nullptr,
+					     &completion_sem, first, i + 1));
+		n_started++;
+		first = i + 1;
+		count = 0;
+	}
+	completion_sem.acquire (n_started);
+
+	std::vector<game_state *> all;
+	for (auto &it: results) {
+		all.insert (all.end (), it.begin (), it.end ());
+		if (first_only && all.size () > 0)
+			break;
+	}
+	return all;
+}
+
+std::vector<game_state *> game_state::find_all (const search_pred &pred)
+{
+	return parallel_search (pred, false);
+}
+
+game_state *game_state::find_first (const search_pred &pred)
+{
+	std::vector<game_state *> r = parallel_search (pred, true);
+	return r.size () > 0 ? r[0] : nullptr;
+}
+
+static uint64_t position_hash (const game_state *st, int ko)
+{
+	const go_board &b = st->get_board ();
+	uint64_t h = st->to_move () == black ? 0x9e3779b97f4a7c15 : 0xc2b2ae3d27d4eb4f;
+	h ^= (uint64_t)(ko + 1) * 0xff51afd7ed558ccd;
+	auto mix = [&h] (const bit_array &a)
+		{
+			const uint64_t *bits = a.raw_bits ();
+			for (unsigned i = 0; i < a.raw_n_elts (); i++) {
+				h ^= bits[i];
+				h *= 0x100000001b3;
+				h ^= h >> 29;
+			}
+		};
+	mix (b.get_stones_b ());
+	mix (b.get_stones_w ());
+	return h;
+}
+
+bool game_state_manager::link_transposition (game_state *st)
+{
+	if (m_positions == nullptr)
+		return false;
+
+	int ko = st->ko_point ();
+	std::vector<position_entry> &bucket = (*m_positions)[position_hash (st, ko)];
+	for (auto &e: bucket) {
+		game_state *first = resolve (e.ref);
+		if (first == st)
+			return false;
+		if (first != nullptr && e.ko == ko && first->to_move () == st->to_move ()
+		    && first->get_board ().position_equal_p (st->get_board ())) {
+			st->m_transposed_from = e.ref;
+			return true;
 		}
-		if (idx >= st->m_children.size ())
-			return nullptr;
-		st = st->m_children[idx];
 	}
-	return st;
+	bucket.push_back ({ st->ref (), ko });
+	return false;
 }
 
+size_t game_record::find_transpositions ()
+{
+	m_positions.reset (new std::unordered_map<uint64_t, std::vector<position_entry>>);
+	size_t count = 0;
+
+	/* Only the nodes that exist so far.  Expanding pending variations here would
+	   defeat lazy loading; insert_child links the nodes when they are added.
+	   The order is that of walk_tree, so the main line comes first.  */
+	std::vector<game_state *> stack { m_root };
+	std::vector<game_state *> variations;
+	while (!stack.empty ()) {
+		game_state *st = stack.back ();
+		stack.pop_back ();
+		for (; st != nullptr; st = st->next_primary_move ()) {
+			st->m_transposed_from = node_ref ();
+			if (link_transposition (st))
+				count++;
+			for (auto &it: st->m_children)
+				if (it != st->m_children[0])
+					variations.push_back (it);
+		}
+		stack.insert (stack.end (), variations.rbegin (), variations.rend ());
+		variations.clear ();
+	}
+	return count;
+}
@@ -5,6 +5,7 @@
 #include "goeval.h"
 
 #include <functional>
+#include <unordered_map>
 #include <QString>
 
 inline std::string komi_str (double k)
@@ -99,6 +100,25 @@ public:
 };
 
 class game_state;
+struct sgf_lazy_source;
+
+/* A reference to a game_state that remains meaningful while the tree is edited, and
+   that can be resolved in constant time.  The id is the node's slot in its manager,
+   the serial number guards against the slot having been reused for another node.
+   Copies of a game_record keep both, so a reference taken in one record resolves to
+   the corresponding node in a copy.  */
+struct node_ref
+{
+	int id = -1;
+	unsigned serial = 0;
+
+	bool valid () const { return id >= 0; }
+	bool operator== (const node_ref &other) const
+	{
+		return id == other.id && serial == other.serial;
+	}
+	bool operator!= (const node_ref &other) const { return !(*this == other); }
+};
 
 /* A memory allocator for game_state structures.  One of these is associated with every
    game_record, to make sure all game_states are deleted when the game is destroyed.  */
@@ -108,13 +128,66 @@ class game_state_manager
 	std::vector<char *> m_game_states;
 	bit_array m_free = bit_array (m_n_per_chunk, false);
 	int m_first_free = 0;
+	unsigned m_next_serial = 1;
+
+	/* All analyzers which have evaluations in nodes of this manager.  */
+	std::vector<analyzer_id> m_analyzers;
+
+	/* Set if the tree was loaded with lazy variations; see sgf2record_lazy.  */
+	std::shared_ptr<sgf_lazy_source> m_lazy_source;
+
+	char *slot_address (int id) const;
+
+protected:
+	/* Built by game_record::find_transpositions: for each position hash, the nodes
+	   where a position first occurs, so that nodes added later can be linked to
+	   them.  Null while transpositions aren't tracked.  */
+	struct position_entry
+	{
+		node_ref ref;
+		int ko;
+	};
+	std::unique_ptr<std::unordered_map<uint64_t, std::vector<position_entry>>> m_positions;
 
 public:
 	~game_state_manager ();
 
 	template<typename ... ARGS> game_state *create_game_state (ARGS &&... args);
+	template<typename ... ARGS> game_state *create_game_state_at (int id, ARGS &&... args);
 	void release_game_state (game_state *st);
 	void release_state_children (game_state *st);
+	/* Make room for N game states, for callers building large trees in one go.  */
+	void reserve (size_t n);
+
+	game_state *find_by_id (int id) const;
+	game_state *resolve (const node_ref &) const;
+
+	bool transpositions_linked () const
+	{
+		return m_positions != nullptr;
+	}
+	/* If transpositions are tracked, link ST to an earlier node with the same
+	   position, or remember it as the first one.  Returns true if it was linked.  */
+	bool link_transposition (game_state *st);
+
+	uint16_t intern_analyzer (const analyzer_id &);
+	/* The index of ID in the table of analyzers, or -1 if it was never
+	   interned.  Entries are not removed when evaluations are deleted, so
+	   an index may be returned even if no node uses the analyzer anymore.  */
+	int find_analyzer (const analyzer_id &) const;
+	const analyzer_id &analyzer (uint16_t idx) const
+	{
+		return m_analyzers[idx];
+	}
+
+	void set_lazy_source (const std::shared_ptr<sgf_lazy_source> &src)
+	{
+		m_lazy_source = src;
+	}
+	sgf_lazy_source *lazy_source () const
+	{
+		return m_lazy_source.get ();
+	}
 };
 
 class game_state
@@ -122,6 +195,7 @@ class game_state
 private:
 	game_state_manager *m_manager;
 	int m_id;
+	unsigned m_serial = 0;
 
 	go_board m_board;
 	/* The move number within this game tree.  Unaffected by SGF MN properties.  */
@@ -130,6 +204,11 @@ private:
 	int m_sgf_movenum;
 
 	std::vector<game_state *> m_children;
+	/* For trees loaded with lazy variations: a list of SGF siblings that still
+	   need to be converted and appended to m_children.  The primary child always
+	   exists already, so code that only follows the main line or the active
+	   variation can ignore this.  Everything else calls expand first.  */
+	sgf::node *m_pending = nullptr;
 	size_t m_active = 0;
 	game_state *m_parent;
 	stone_color m_to_move;
@@ -161,8 +240,13 @@ private:
 	int m_print_numbering = -1;
 	sgf_figure m_figure;
 
-	std::vector<eval> m_evals;
+	std::vector<stored_eval> m_evals;
 	eval m_live_eval;
+	/* Set by game_state_manager::link_transposition if an earlier node has the same
+	   position (a transposition, reached by a different move order).  Lookups fall
+	   back to its evaluations for analyzers this node has none from.  The node may
+	   have been deleted or edited since, so this is checked whenever it is used.  */
+	node_ref m_transposed_from;
 
 	/* Support for SGF VW.  */
 	bit_array *m_visible {};
@@ -172,6 +256,7 @@ private:
 	void operator delete (void *) { std::terminate (); }
 
 	friend class game_state_manager;
+	friend class game_record;
 	game_state (game_state_manager *gm, int id, const go_board &b, int move, int sgf_move, game_state *parent, stone_color to_move)
 		: m_manager (gm), m_id (id), m_board (b), m_move_number (move), m_sgf_movenum (sgf_move), m_parent (parent), m_to_move (to_move)
 	{
@@ -195,7 +280,31 @@ private:
 	{
 	}
 
+	void copy_from (const game_state &other, bool same_ids);
+	void materialize_pending ();
+	bool pending_has_figure () const;
+	void expand () const
+	{
+		if (m_pending != nullptr)
+			const_cast<game_state *> (this)->materialize_pending ();
+	}
+	eval unpack_eval (const stored_eval &) const;
+	stored_eval pack_eval (const eval &);
+	void update_stored_eval (const stored_eval &);
+	bool find_own_eval (int idx, eval &ev) const
+	{
+		for (const auto &e: m_evals)
+			if (e.id == idx) {
+				ev = unpack_eval (e);
+				return true;
+			}
+		return false;
+	}
+
 public:
+	/* Used as a tag for the deep copy constructor.  */
+	enum same_ids { same_ids };
+
 	game_state (game_state_manager *gm, int id, int size)
 		: m_manager (gm), m_id (id), m_board (size), m_move_number (0), m_sgf_movenum (0), m_parent (0), m_to_move (black)
 	{
@@ -210,20 +319,17 @@ public:
 			      other.m_move_x, other.m_move_y, other.m_move_color, other.m_unrecognized_props,
 			      other.m_visualized, other.m_visual_ok, other.m_visible)
 	{
-		for (auto c: other.m_children) {
-			game_state *new_c = m_manager->create_game_state (*c, this);
-			m_children.push_back (new_c);
-		}
-		m_comment = other.m_comment;
-		m_active = other.m_active;
-		m_figure = other.m_figure;
-		m_print_numbering = other.m_print_numbering;
-		m_evals = other.m_evals;
-
-		m_timeleft_w = other.m_timeleft_w;
-		m_timeleft_b = other.m_timeleft_b;
-		m_stonesleft_w = other.m_stonesleft_w;
-		m_stonesleft_b = other.m_stonesleft_b;
+		copy_from (other, false);
+	}
+	/* Deep copy into a different manager, keeping the ids and serial numbers of all
+	   nodes so that node_refs remain valid for the copy.  */
+	game_state (game_state_manager *gm, int id, const game_state &other, game_state *parent, enum same_ids)
+		: game_state (gm, id, other.m_board, other.m_move_number, other.m_sgf_movenum, parent, other.m_to_move,
+			      other.m_move_x, other.m_move_y, other.m_move_color, other.m_unrecognized_props,
+			      other.m_visualized, other.m_visual_ok, other.m_visible)
+	{
+		m_serial = other.m_serial;
+		copy_from (other, true);
 	}
 	void operator delete (void *, void *) throw ()
 	{
@@ -263,10 +369,33 @@ public:
 	{
 		return m_manager->create_game_state (*this, parent);
 	}
+	int id () const
+	{
+		return m_id;
+	}
+	node_ref ref () const
+	{
+		node_ref r;
+		r.id = m_id;
+		r.serial = m_serial;
+		return r;
+	}
 	void set_unrecognized (const sgf::node::proplist &list)
 	{
 		m_unrecognized_props = list;
 	}
+	/* Used by the SGF loader to defer converting the variations after the
+	   primary child.  */
+	void set_pending (sgf::node *n)
+	{
+		m_pending = n;
+	}
+	/* True if this node has variations that are not converted yet.  They are
+	   not part of the visualization until then.  */
+	bool has_pending_variations () const
+	{
+		return m_pending != nullptr;
+	}
 	stone_color to_move () const
 	{
 		return m_to_move;
@@ -395,16 +524,23 @@ public:
 private:
 	game_state *insert_child (game_state *tmp, add_mode am)
 	{
+		expand ();
 		m_visual_ok = false;
 		m_children.push_back (tmp);
 		if (am == add_mode::set_active)
 			m_active = m_children.size() - 1;
+		m_manager->link_transposition (tmp);
 		return tmp;
 	}
 
 public:
 	void add_child_tree_at (game_state *c, size_t idx)
 	{
+		expand ();
+		/* Pending variations are converted using the source of the manager that
+		   created them, so do that before the subtree moves to another tree.  */
+		if (c->m_manager != m_manager)
+			c->walk_tree ([] (game_state *) { return true; });
 		m_visual_ok = false;
 		c->disconnect ();
 		m_children.insert (std::begin (m_children) + idx, c);
@@ -444,6 +580,7 @@ public:
 
 	game_state *add_child_edit (const go_board &new_board, stone_color to_move, bool scored = false, add_mode am = add_mode::set_active)
 	{
+		expand ();
 		for (const auto &it: m_children)
 			if (it->m_board == new_board && it->m_to_move == to_move)
 				return it;
@@ -461,6 +598,7 @@ public:
 
 	game_state *add_child_move (const go_board &new_board, stone_color to_move, int x, int y, add_mode am = add_mode::set_active)
 	{
+		expand ();
 		for (const auto &it: m_children)
 			if (it->was_move_p () && it->m_board == new_board)
 				return it;
@@ -475,6 +613,7 @@ public:
 		go_board new_board (m_board, mark::none);
 		new_board.add_stone (x, y, to_move);
 		if (!dup) {
+			expand ();
 			for (const auto &it: m_children)
 				if (it->was_move_p () && it->m_board.position_equal_p (new_board))
 					return it;
@@ -497,6 +636,7 @@ public:
 	}
 	game_state *add_child_pass (const go_board &new_board, add_mode am = add_mode::set_active)
 	{
+		expand ();
 		for (const auto &it: m_children)
 			if (it->m_board == new_board && it->was_pass_p ())
 				return it;
@@ -506,8 +646,11 @@ public:
 	{
 		return add_child_pass (m_board, am);
 	}
+	/* This walks the new subtree, which also converts any pending variations
+	   in it; see add_child_tree_at.  */
 	void add_child_tree (game_state *other)
 	{
+		expand ();
 		m_children.push_back (other);
 		auto callback = [] (game_state *st) -> bool {
 			st->m_move_number = st->m_parent->m_move_number + 1; return true;
@@ -547,6 +690,7 @@ public:
 	{
 		if (m_parent == nullptr)
 			return false;
+		m_parent->expand ();
 		return m_parent->m_children.back () != this;
 	}
 	bool has_prev_sibling () const
@@ -559,6 +703,7 @@ public:
 	{
 		if (m_parent == nullptr)
 			return this;
+		m_parent->expand ();
 		size_t n = m_parent->m_children.size ();
 		size_t ret = n - 1;
 		while (n-- > 0) {
@@ -593,6 +738,7 @@ public:
 	{
 		if (m_parent == nullptr)
 			return 0;
+		m_parent->expand ();
 		return m_parent->m_children.size () - 1;
 	}
 	size_t var_number () const
@@ -606,16 +752,19 @@ public:
 	}
 	size_t n_children () const
 	{
+		expand ();
 		return m_children.size ();
 	}
 	/* I didn't really want to expose this, but avoiding it leads to contortions
 	   in some places, e.g. when trying to identify figures.  */
 	const std::vector<game_state *> children () const
 	{
+		expand ();
 		return m_children;
 	}
 	std::vector<game_state *> take_children ()
 	{
+		expand ();
 		std::vector<game_state *> tmp;
 		std::swap (tmp, m_children);
 		m_active = 0;
@@ -626,6 +775,7 @@ public:
 	}
 	game_state *find_child_move (int x, int y)
 	{
+		expand ();
 		for (const auto &it: m_children)
 			if (it->was_move_p () && it->m_move_x == x && it->m_move_y == y)
 				return it;
@@ -646,9 +796,6 @@ public:
 			return go_board (m_board.size_x (), m_board.size_y ());
 		return p->child_moves (this, exclude_figs);
 	}
-	std::vector<int> path_from_root ();
-	game_state *follow_path (const std::vector<int> &);
-
 	/* Set a mark on the current board, and return true if that made a change.  */
 	bool set_mark (int x, int y, mark m, mextra extra)
 	{
@@ -674,6 +821,8 @@ public:
 	void update_eval (const game_state &other);
 	eval best_eval ();
 	eval eval_from (const analyzer_id &id, bool require);
+	/* The number of evaluations stored in this node, not counting those of a
+	   transposition.  */
 	size_t eval_count () const
 	{
 		return m_evals.size ();
@@ -682,7 +831,14 @@ public:
 	void collect_analyzers (std::function<void (const analyzer_id &, bool)> &callback)
 	{
 		for (const auto &it: m_evals)
-			callback (it.id, it.score_stddev != 0);
+			callback (m_manager->analyzer (it.id), it.score_stddev != 0);
+		const game_state *src = transposition_source ();
+		if (src == nullptr)
+			return;
+		eval ev;
+		for (const auto &it: src->m_evals)
+			if (!find_own_eval (it.id, ev))
+				callback (m_manager->analyzer (it.id), it.score_stddev != 0);
 	}
 	void set_eval_data (int visits, double winrate_black, analyzer_id id)
 	{
@@ -702,20 +858,41 @@ public:
 		ev.score_stddev = scored;
 		update_eval (ev);
 	}
+	/* The index of an analyzer in the game's table, for use with find_eval.  */
+	int analyzer_index (const analyzer_id &id) const
+	{
+		return m_manager->find_analyzer (id);
+	}
+	bool find_eval (int idx, eval &ev)
+	{
+		if (idx < 0)
+			return false;
+		if (find_own_eval (idx, ev))
+			return true;
+		const game_state *src = transposition_source ();
+		return src != nullptr && src->find_own_eval (idx, ev);
+	}
 	bool find_eval (const analyzer_id &id, eval &ev)
 	{
-		for (const auto &e: m_evals)
-			if (e.id == id) {
-				ev = e;
-				return true;
-			}
-		return false;
+		return find_eval (analyzer_index (id), ev);
 	}
-	void append_to_sgf (std::string &, bool active_only) const;
+	/* The earlier node with the same position, if this is a transposition.  */
+	const game_state *transposition_source () const;
+	bool transposition_p () const
+	{
+		return transposition_source () != nullptr;
+	}
+	/* The point which may not be played immediately because this move took a ko,
+	   as a bit position, or -1.  */
+	int ko_point () const;
+
+	void append_to_sgf (sgf_writer &, bool active_only) const;
 
 	/* Used for edits: modifying an existing edit (or root) node, or applying marks.  */
 	void replace (const go_board &b, stone_color to_move)
 	{
+		if (!m_board.position_equal_p (b) || m_to_move != to_move)
+			m_transposed_from = node_ref ();
 		m_board = b;
 		m_to_move = to_move;
 	}
@@ -807,8 +984,33 @@ public:
 	bool vis_expand_one ();
 
 	void walk_tree (const std::function<bool (game_state *)> &);
+
+	/* Search functions for large trees.  The predicate is evaluated in parallel on the
+	   global thread pool, so it must not modify the tree, and these must not be called
+	   from a job in that pool.  Results are returned in the same order that walk_tree
+	   would visit the nodes.  Variations that are still pending are not searched.  */
+	typedef std::function<bool (const game_state *)> search_pred;
+	std::vector<game_state *> find_all (const search_pred &);
+	game_state *find_first (const search_pred &);
+
+private:
+	typedef std::pair<game_state *, size_t> tree_segment;
+	void collect_segments (std::vector<tree_segment> &);
+	std::vector<game_state *> parallel_search (const search_pred &, bool first_only);
 };
 
+inline char *game_state_manager::slot_address (int id) const
+{
+	return m_game_states[id / m_n_per_chunk] + (id % m_n_per_chunk) * sizeof (game_state);
+}
+
+inline game_state *game_state_manager::find_by_id (int id) const
+{
+	if (id < 0 || (size_t)id >= m_game_states.size () * m_n_per_chunk || !m_free.test_bit (id))
+		return nullptr;
+	return (game_state *)slot_address (id);
+}
+
 template<typename ... ARGS>
 game_state *game_state_manager::create_game_state (ARGS &&... args)
 {
@@ -829,6 +1031,26 @@ game_state *game_state_manager::create_game_state (ARGS &&... args)
 	m_free.set_bit (free_elt);
 	char *ptr = arena + (free_elt % m_n_per_chunk) * sizeof (game_state);
 	game_state *gs = new (ptr) game_state (this, free_elt, std::forward<ARGS>(args)...);
+	gs->m_serial = m_next_serial++;
+	return gs;
+}
+
+/* Create a game state in a specific slot, which must be free.  Used when copying a
+   tree into a new manager while keeping node ids.  The constructor is responsible
+   for setting the serial number.  */
+template<typename ... ARGS>
+game_state *game_state_manager::create_game_state_at (int id, ARGS &&... args)
+{
+	while ((size_t)id >= m_game_states.size () * m_n_per_chunk) {
+		size_t n_elts = m_game_states.size () * m_n_per_chunk;
+		m_game_states.push_back (new char[sizeof (game_state) * m_n_per_chunk]);
+		m_free.grow (n_elts + m_n_per_chunk);
+	}
+	if (m_free.test_bit (id))
+		throw std::logic_error ("game state slot already in use");
+	m_free.set_bit (id);
+	game_state *gs = new (slot_address (id)) game_state (this, id, std::forward<ARGS>(args)...);
+	m_next_serial = std::max (m_next_serial, gs->m_serial + 1);
 	return gs;
 }
 
@@ -876,6 +1098,10 @@ extern void db_info_from_sgf (go_board &b, sgf::node *n, bool is_root, sgf_error
 
 extern game_state *sgf2board (sgf &);
 extern go_game_ptr sgf2record (const sgf &, QTextCodec *codec);
+/* Like sgf2record, but only the main line of each variation is converted
+   immediately.  The other variations are kept as SGF nodes and converted the
+   first time they are needed, so the record keeps the parsed file alive.  */
+extern go_game_ptr sgf2record_lazy (const std::shared_ptr<sgf> &, QTextCodec *codec);
 extern std::string record2sgf (const game_record &);
 
 class game_record : public game_state_manager
@@ -908,10 +1134,14 @@ public:
 	{
 		m_root = create_game_state (b, to_move);
 	}
+	/* The copy keeps node ids, so node_refs can be used to find corresponding
+	   positions in both records.  */
 	game_record (const game_record &other) : m_info (other.m_info),
 		m_modified (other.m_modified), m_errors (other.m_errors), m_mask (other.m_mask)
 	{
-		m_root = create_game_state (*other.m_root, nullptr);
+		m_root = create_game_state_at (other.m_root->id (), *other.m_root, nullptr, game_state::same_ids);
+		if (other.transpositions_linked ())
+			find_transpositions ();
 	}
 
 	const game_info &info () { return m_info; }
@@ -957,7 +1187,17 @@ public:
 	{
 		return m_modified;
 	}
+	bool write_sgf (sgf_writer &, bool active_only = false) const;
 	std::string to_sgf (bool active_only = false) const;
+	/* Find nodes with identical positions (stones, player to move and ko) and link
+	   each to the first occurrence, then keep doing so for moves added later,
+	   including variations converted by expand.  Pending variations are not
+	   converted for this.  Returns the number of transpositions found.  */
+	size_t find_transpositions ();
+	/* For records loaded with lazy variations: convert all remaining ones.  Returns
+	   false if some were broken and had to be left out, which means the record no
+	   longer holds everything in the file it was loaded from.  */
+	bool materialize_all ();
 	void set_errors (const sgf_errors &errs)
 	{
 		m_errors = errs;
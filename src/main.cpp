@@ -15,6 +15,14 @@
 #include <QMessageBox>
 #include <QCommandLineParser>
 #include <QDir>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QProgressDialog>
+
+#include <atomic>
+#include <cstring>
 
 #include "config.h"
 #include "sgf.h"
@@ -33,6 +41,7 @@
 #include "tutorial.h"
 #include "tips.h"
 #include "patternsearch.h"
+#include "gamedb.h"
 
 qGo *qgo;
 QApplication *qgo_app;
@@ -118,68 +127,219 @@ go_game_ptr new_variant_game_dialog (QWidget *parent)
 	return gr;
 }
 
+/* The messages describing the problems found in ERRS, which did not prevent
+   the file from being loaded.  */
+static QStringList error_messages (const sgf_errors &errs)
+{
+	QStringList msgs;
+	if (errs.invalid_structure)
+		msgs << QObject::tr ("The file did not quite have the correct structure of an SGF file, but could otherwise be understood.");
+	if (errs.played_on_stone)
+		msgs << QObject::tr ("The SGF file contained an invalid move that was played on top of another stone. Variations have been truncated at that point.");
+	if (errs.charset_error)
+		msgs << QObject::tr ("One or more comments have been dropped since they contained invalid characters.");
+	if (errs.empty_komi)
+		msgs << QObject::tr ("The SGF contained an empty value for komi. Assuming zero.");
+	if (errs.empty_handicap)
+		msgs << QObject::tr ("The SGF contained an empty value for the handicap. Assuming zero.");
+	if (errs.invalid_val)
+		msgs << QObject::tr ("The SGF contained an invalid value in a property related to display.  Things like move numbers might not show up correctly.");
+	if (errs.malformed_eval)
+		msgs << QObject::tr ("The SGF contained evaluation data that could not be understood.");
+	if (errs.move_outside_board)
+		msgs << QObject::tr ("The SGF contained moves outside of the board area.  They were converted to passes.");
+	return msgs;
+}
+
 static void warn_errors (go_game_ptr gr)
 {
-	const sgf_errors &errs = gr->errors ();
-	if (errs.invalid_structure) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The file did not quite have the correct structure of an SGF file, but could otherwise be understood."));
-	}
-	if (errs.played_on_stone) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF file contained an invalid move that was played on top of another stone. Variations have been truncated at that point."));
-	}
-	if (errs.charset_error) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("One or more comments have been dropped since they contained invalid characters."));
-	}
-	if (errs.empty_komi) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF contained an empty value for komi. Assuming zero."));
-	}
-	if (errs.empty_handicap) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF contained an empty value for the handicap. Assuming zero."));
-	}
-	if (errs.invalid_val) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF contained an invalid value in a property related to display.  Things like move numbers might not show up correctly."));
-	}
-	if (errs.malformed_eval) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF contained evaluation data that could not be understood."));
-	}
-	if (errs.move_outside_board) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The SGF contained moves outside of the board area.  They were converted to passes."));
+	for (auto &msg: error_messages (gr->errors ()))
+		QMessageBox::warning (0, PACKAGE, msg);
+}
+
+/* The message to show for an exception that occurred while loading an SGF file.  */
+static QString load_error_message (const std::exception_ptr &e)
+{
+	try {
+		std::rethrow_exception (e);
+	} catch (invalid_boardsize &) {
+		return QObject::tr ("Unsupported board size in SGF file.");
+	} catch (old_sgf_format &) {
+		return QObject::tr ("The file uses an obsolete SGF format from 1993 that is no longer supported.\nIf you are using Jago, make sure the \"Pure SGF\" option is checked before saving.");
+	} catch (broken_sgf &) {
+		return QObject::tr ("Errors found in SGF file.");
+	} catch (...) {
+		return QObject::tr ("Error while trying to load SGF file.");
 	}
 }
 
-/* A wrapper around sgf2record to handle exceptions with message boxes.  */
+/* A wrapper around sgf2record to handle exceptions with message boxes.
+   GAME selects a game from a collection; FILENAME is needed to find its
+   index in that case.  */
 
-go_game_ptr record_from_stream (QIODevice &isgf, QTextCodec* codec)
+static go_game_ptr record_from_adapter (const IODeviceAdapter &in, QTextCodec* codec,
+					const QString &filename, size_t game, size_t *n_games = nullptr)
 {
 	try {
-		sgf *sgf = load_sgf (isgf);
-		go_game_ptr gr = sgf2record (*sgf, codec);
-		delete sgf;
+		std::shared_ptr<sgf> sgf (load_sgf_game (filename, in, game, n_games));
+		go_game_ptr gr = (setting->readBoolEntry ("SGF_LAZY")
+				  ? sgf2record_lazy (sgf, codec) : sgf2record (*sgf, codec));
 		warn_errors (gr);
 		return gr;
-	} catch (invalid_boardsize &) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("Unsupported board size in SGF file."));
-	} catch (old_sgf_format &) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("The file uses an obsolete SGF format from 1993 that is no longer supported.\nIf you are using Jago, make sure the \"Pure SGF\" option is checked before saving."));
-	} catch (broken_sgf &) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("Errors found in SGF file."));
 	} catch (...) {
-		QMessageBox::warning (0, PACKAGE, QObject::tr ("Error while trying to load SGF file."));
+		QMessageBox::warning (0, PACKAGE, load_error_message (std::current_exception ()));
 	}
 	return nullptr;
 }
 
-go_game_ptr record_from_file (const QString &filename, QTextCodec* codec)
+go_game_ptr record_from_stream (QIODevice &isgf, QTextCodec* codec)
+{
+	IODeviceAdapter in (isgf);
+	return record_from_adapter (in, codec, QString (), 0);
+}
+
+go_game_ptr record_from_file (const QString &filename, QTextCodec* codec, size_t game)
 {
 	QFile f (filename);
 	f.open (QIODevice::ReadOnly);
 
-	go_game_ptr gr = record_from_stream (f, codec);
-	if (gr != nullptr)
+	IODeviceAdapter in (f);
+	size_t n_games = 0;
+	go_game_ptr gr = record_from_adapter (in, codec, filename, game, &n_games);
+	/* Saving a game from a collection under the collection's name would
+	   destroy all the others.  Leave the name unset so the user is asked
+	   for one.  */
+	if (gr != nullptr && n_games == 1)
 		gr->set_filename (filename.toStdString ());
 	return gr;
 }
 
+/* Loading many files at once.  Parsing and conversion need no GUI, so each
+   file is handled by a job in a thread pool.  */
+
+struct file_load_slot
+{
+	go_game_ptr game;
+	std::exception_ptr error;
+	/* Why the file was passed over, if it was.  */
+	QString skipped;
+	std::atomic<bool> done { false };
+};
+
+class FileLoad : public QRunnable
+{
+	QString m_filename;
+	QTextCodec *m_codec;
+	bool m_lazy;
+	const std::function<QString (const sgf &)> &m_reject;
+	file_load_slot *m_slot;
+	const std::atomic<bool> *m_cancel;
+	QSemaphore *m_sem;
+
+public:
+	FileLoad (const QString &f, QTextCodec *codec, bool lazy, const std::function<QString (const sgf &)> &reject,
+		  file_load_slot *slot, const std::atomic<bool> *cancel, QSemaphore *s)
+		: m_filename (f), m_codec (codec), m_lazy (lazy), m_reject (reject), m_slot (slot),
+		  m_cancel (cancel), m_sem (s)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		if (!*m_cancel) {
+			try {
+				QFile f (m_filename);
+				f.open (QIODevice::ReadOnly);
+				IODeviceAdapter in (f);
+				size_t n_games = 0;
+				std::shared_ptr<sgf> s (load_sgf_game (m_filename, in, 0, &n_games));
+				/* Checked before conversion, which is the expensive part.  */
+				if (m_reject != nullptr)
+					m_slot->skipped = m_reject (*s);
+				if (m_slot->skipped.isEmpty ()) {
+					go_game_ptr gr = m_lazy ? sgf2record_lazy (s, m_codec) : sgf2record (*s, m_codec);
+					/* As in record_from_file.  */
+					if (n_games == 1)
+						gr->set_filename (m_filename.toStdString ());
+					m_slot->game = gr;
+				}
+			} catch (...) {
+				m_slot->error = std::current_exception ();
+			}
+		}
+		m_slot->done.store (true, std::memory_order_release);
+		m_sem->release ();
+	}
+};
+
+/* Load FILES in parallel, and pass each successfully loaded record to CALLBACK
+   on the GUI thread, in the order of FILES.  A progress dialog is shown for
+   longer runs, and the GUI stays responsive.  If REJECT is given, it is called
+   on the loader threads with each parsed file, and a file is passed over if it
+   returns a reason.  Files that fail to load or are passed over, and problems
+   found in the others, are reported together at the end.  Returns false if the
+   user canceled.  */
+
+bool records_from_files (QWidget *parent, const QStringList &files, QTextCodec *codec,
+			 const std::function<void (const QString &, go_game_ptr)> &callback,
+			 const std::function<QString (const sgf &)> &reject)
+{
+	size_t n = files.size ();
+	std::vector<file_load_slot> slots (n);
+	std::atomic<bool> cancel { false };
+	QSemaphore sem (0);
+	bool lazy = setting->readBoolEntry ("SGF_LAZY");
+
+	QProgressDialog dlg (QObject::tr ("Loading SGF files..."), QObject::tr ("Cancel"), 0, n, parent);
+	dlg.setWindowModality (Qt::WindowModal);
+	dlg.setMinimumDuration (500);
+
+	QThreadPool pool;
+	for (size_t i = 0; i < n; i++)
+		pool.start (new FileLoad (files[i], codec, lazy, reject, &slots[i], &cancel, &sem));
+
+	QString errors, warnings, skipped;
+	size_t next = 0;
+	while (next < n && !dlg.wasCanceled ()) {
+		file_load_slot &slot = slots[next];
+		if (!slot.done.load (std::memory_order_acquire)) {
+			/* The semaphore only serves to wake us up early.  */
+			sem.tryAcquire (1, 20);
+			QCoreApplication::processEvents ();
+			continue;
+		}
+		if (slot.game != nullptr) {
+			for (auto &msg: error_messages (slot.game->errors ()))
+				warnings += "  " + files[next] + ": " + msg + "\n";
+			callback (files[next], slot.game);
+		} else if (!slot.skipped.isEmpty ())
+			skipped += "  " + files[next] + ": " + slot.skipped + "\n";
+		else
+			errors += "  " + files[next] + ": " + load_error_message (slot.error) + "\n";
+		slot.game = nullptr;
+		dlg.setValue (++next);
+	}
+	cancel = true;
+	pool.waitForDone ();
+
+	QString summary;
+	if (!errors.isEmpty ())
+		summary = QObject::tr ("The following files could not be loaded:") + "\n" + errors;
+	if (!warnings.isEmpty ()) {
+		if (!summary.isEmpty ())
+			summary += "\n";
+		summary += QObject::tr ("The following files had problems, but were loaded:") + "\n" + warnings;
+	}
+	if (!skipped.isEmpty ()) {
+		if (!summary.isEmpty ())
+			summary += "\n";
+		summary += QObject::tr ("The following files were not added:") + "\n" + skipped;
+	}
+	if (!summary.isEmpty ())
+		QMessageBox::warning (parent, PACKAGE, summary);
+	return next == n;
+}
+
 bool open_window_from_file (const QString &filename, QTextCodec* codec)
 {
 	go_game_ptr gr = record_from_file (filename, codec);
@@ -205,15 +365,13 @@ go_game_ptr open_file_dialog (QWidget *parent)
 		int result = file_open_dialog.exec ();
 		setting->writeEntry (geokey, QString::fromLatin1 (file_open_dialog.saveGeometry ().toHex ()));
 		if (result == QDialog::Accepted) {
-			/* If the file selector successfully loaded a preview, just use
-			   that game record.  Otherwise extract the filename and try to
-			   open it to show message boxes about whatever error occurs.  */
-
-			go_game_ptr gr = file_open_dialog.selected_record ();
-			if (gr != nullptr) {
-				warn_errors (gr);
-				return gr;
-			}
+			/* If the file selector successfully loaded a preview, load the
+			   complete game with the chosen encoding; selected_record shows
+			   message boxes about any errors.  Otherwise extract the filename
+			   and try to open it to report whatever error occurs.  */
+
+			if (file_open_dialog.has_preview ())
+				return file_open_dialog.selected_record ();
 
 			QStringList l = file_open_dialog.selected ();
 			if (!l.isEmpty ())
@@ -235,15 +393,22 @@ go_game_ptr open_file_dialog (QWidget *parent)
 
 bool save_to_file (QWidget *parent, go_game_ptr gr, const QString &filename)
 {
+	/* Writing the file converts any variations that a lazy load left for later.
+	   If some of them turned out to be broken, they are missing from the record,
+	   and overwriting the file they came from would lose them for good.  */
+	if (!gr->materialize_all () && QFileInfo (filename) == QFileInfo (QString::fromStdString (gr->filename ()))) {
+		QMessageBox::warning (parent, PACKAGE, QObject::tr ("Some variations in this file could not be loaded and are missing from the game.
+"
+								      "The file was not overwritten; please save it under a different name."));
+		return false;
+	}
 	QFile of (filename);
 	if (!of.open (QIODevice::WriteOnly)) {
 		QMessageBox::warning (parent, PACKAGE, QObject::tr ("Cannot open SGF file for saving."));
 		return false;
 	}
-	std::string sgf = gr->to_sgf ();
-	QByteArray bytes = QByteArray::fromStdString (sgf);
-	qint64 written = of.write (bytes);
-	if (written != bytes.length ()) {
+	sgf_iodevice_writer w (of);
+	if (!gr->write_sgf (w)) {
 		QMessageBox::warning (parent, PACKAGE, QObject::tr ("Failed to save SGF file."));
 		return false;
 	}
@@ -453,8 +618,89 @@ void show_pattern_search ()
 	patsearch_window->activateWindow ();
 }
 
+static QCommandLineOption clo_build_db { "build-db", QObject::tr ("Build the game database for <dir> without opening any windows, then exit."), QObject::tr ("dir") };
+static QCommandLineOption clo_jobs { "jobs", QObject::tr ("Use <n> threads to build databases (default: one per processor)."), QObject::tr ("n") };
+static QCommandLineOption clo_incremental { "incremental", QObject::tr ("Only parse the files that changed since a database was last built.") };
+
+/* Build the databases given with --build-db.  This only needs a
+   QCoreApplication, so no display or platform plugin is involved.
+   Returns the exit status.  */
+static int build_databases (int argc, char **argv)
+{
+	QCoreApplication app (argc, argv);
+	QTextStream out (stdout);
+	QTextStream err (stderr);
+
+	QCommandLineParser cmdp;
+	cmdp.addOption (clo_build_db);
+	cmdp.addOption (clo_jobs);
+	cmdp.addOption (clo_incremental);
+	cmdp.addHelpOption ();
+	cmdp.process (app);
+
+	int n_jobs = 0;
+	if (cmdp.isSet (clo_jobs)) {
+		bool ok;
+		n_jobs = cmdp.value (clo_jobs).toInt (&ok);
+		if (!ok || n_jobs < 1) {
+			err << QObject::tr ("Invalid number of jobs: %1").arg (cmdp.value (clo_jobs)) << "\n";
+			return 2;
+		}
+	}
+	bool update = cmdp.isSet (clo_incremental);
+
+	int status = 0;
+	for (const auto &dirname: cmdp.values (clo_build_db)) {
+		if (!QFileInfo (dirname).isDir ()) {
+			err << QObject::tr ("%1: not a directory").arg (dirname) << "\n";
+			status = 1;
+			continue;
+		}
+		out << QObject::tr ("Building database for %1").arg (dirname) << "\n";
+		out.flush ();
+
+		QElapsedTimer timer;
+		timer.start ();
+		qint64 last_report = 0;
+		db_build_stats stats;
+		bool ok = build_db_for_dir (dirname, update, n_jobs,
+					    [&] (int done, int total) -> bool
+					    {
+						    if (timer.elapsed () - last_report >= 1000) {
+							    last_report = timer.elapsed ();
+							    out << "  " << done << "/" << total << "\n";
+							    out.flush ();
+						    }
+						    return true;
+					    }, stats);
+		double secs = timer.elapsed () / 1000.0;
+		if (!ok) {
+			err << QObject::tr ("%1: failed to write the database").arg (dirname) << "\n";
+			status = 1;
+			continue;
+		}
+		if (stats.unchanged)
+			out << QObject::tr ("  up to date: %1 games in %2 files").arg (stats.n_games).arg (stats.n_files) << "\n";
+		else
+			out << QObject::tr ("  %1 games from %2 files, %3 parsed in %4 s").arg (stats.n_games).arg (stats.n_files)
+				.arg (stats.n_parsed).arg (secs, 0, 'f', 1) << "\n";
+		if (stats.n_failed > 0) {
+			err << QObject::tr ("%1: %2 files could not be read, or had games that could not be parsed")
+				.arg (dirname).arg (stats.n_failed) << "\n";
+			status = 1;
+		}
+		out.flush ();
+	}
+	return status;
+}
+
 int main(int argc, char **argv)
 {
+	/* Decide before creating a QApplication, which would need a display.  */
+	for (int i = 1; i < argc; i++)
+		if (strcmp (argv[i], "--build-db") == 0 || strncmp (argv[i], "--build-db=", 11) == 0)
+			return build_databases (argc, argv);
+
 	QApplication::setAttribute (Qt::AA_EnableHighDpiScaling);
 
 	QApplication myapp(argc, argv);
@@ -478,11 +724,20 @@ int main(int argc, char **argv)
 	cmdp.addOption (clo_debug_file);
 #endif
 	cmdp.addOption (clo_encoding);
+	cmdp.addOption (clo_build_db);
+	cmdp.addOption (clo_jobs);
+	cmdp.addOption (clo_incremental);
 	cmdp.addHelpOption ();
 	cmdp.addPositionalArgument ("file", QObject::tr ("Load <file> and display it in a board window."));
 
 	cmdp.process (myapp);
 	const QStringList args = cmdp.positionalArguments ();
+	/* These are only listed here for --help; they mean nothing without --build-db.  */
+	if (cmdp.isSet (clo_jobs) || cmdp.isSet (clo_incremental)) {
+		QTextStream err (stderr);
+		err << QObject::tr ("--jobs and --incremental can only be used together with --build-db.") << "\n";
+		return 2;
+	}
 
 	bool show_client = cmdp.isSet (clo_client);
 
@@ -549,12 +804,23 @@ int main(int argc, char **argv)
 		codec = QTextCodec::codecForName(encoding.toUtf8());
 	}
 	QStringList not_found;
+	QStringList to_open;
 	for (const auto &arg: args) {
 		if (QFile::exists(arg))
-			windows_open |= open_window_from_file (arg, codec);
+			to_open << arg;
 		else
 			not_found << arg;
 	}
+	if (to_open.size () == 1)
+		windows_open = open_window_from_file (to_open[0], codec);
+	else if (!to_open.isEmpty ())
+		records_from_files (nullptr, to_open, codec,
+				    [&windows_open] (const QString &, go_game_ptr gr)
+				    {
+					    MainWindow *win = new MainWindow (0, gr);
+					    win->show ();
+					    windows_open = true;
+				    });
 	if (cmdp.isSet (clo_board) && !windows_open) {
 		open_local_board (client_window, game_dialog_type::none, QString ());
 		windows_open = true;
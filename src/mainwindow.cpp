@@ -690,6 +690,8 @@ void MainWindow::init_game_record (go_game_ptr gr)
 	game_state *root = gr->get_root ();
 	const go_board b (root->get_board (), none);
 	m_empty_state = gr->create_game_state (b, black);
+	if (setting->values.gametree_transpos)
+		gr->find_transpositions ();
 
 	/* The order actually matters here.  The gfx_board will call back into MainWindow
 	   to update figures, which means we need to have ui->diagView set up.  */
@@ -1680,7 +1682,7 @@ void MainWindow::slotPlayFromHere (bool)
 	const Engine &engine = setting->m_engines[eidx];
 	std::shared_ptr<game_record> gr = std::make_shared<game_record> (*m_game);
 	game_state *curr_pos = ui->gfx_board->displayed ();
-	game_state *st = gr->get_root ()->follow_path (curr_pos->path_from_root ());
+	game_state *st = gr->resolve (curr_pos->ref ());
 
 	bool computer_white = dlg.computer_white_p ();
 	time_settings ts = dlg.timing ();
@@ -1926,6 +1928,8 @@ void MainWindow::update_settings ()
 	bool disable_rect = (b.torus_h () || b.torus_v ()) && setting->readIntEntry ("TOROID_DUPS") > 0;
 	ui->editRectSelect->setEnabled (!disable_rect);
 
+	if (setting->values.gametree_transpos && !m_game->transpositions_linked ())
+		m_game->find_transpositions ();
 	ui->gameTreeView->update_prefs ();
 
 	if (slideView != nullptr)
@@ -4105,7 +4109,7 @@ void MainWindow::perform_search ()
 {
         go_game_ptr gr = std::make_shared<game_record> (*m_game);
         game_state *curr_pos = ui->gfx_board->displayed ();
-        game_state *st = gr->get_root ()->follow_path (curr_pos->path_from_root ());
+        game_state *st = gr->resolve (curr_pos->ref ());
 
 	show_pattern_search ();
 
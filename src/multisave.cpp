@@ -78,10 +78,8 @@ bool MultiSaveDialog::save_one (const QString &pattern, int count)
 		QMessageBox::warning (this, PACKAGE, tr("Cannot open SGF file for saving."));
 		return false;
 	}
-	std::string sgf_str = m_game->to_sgf (true);
-	QByteArray bytes = QByteArray::fromStdString (sgf_str);
-	qint64 written = f.write (bytes);
-	if (written != bytes.length ()) {
+	sgf_iodevice_writer w (f);
+	if (!m_game->write_sgf (w, true)) {
 		QMessageBox::warning (this, PACKAGE, tr("Failed to save SGF file."));
 		return false;
 	}
@@ -7,6 +7,8 @@
 #include <QMutex>
 
 #include <string>
+#include <unordered_map>
+#include <map>
 
 #include "gogame.h"
 #include "pattern.h"
@@ -277,16 +279,19 @@ bool go_pattern::match (const bit_array &other_w, const bit_array &other_b, unsi
 	return false;
 }
 
-void go_pattern::find_cands (std::vector<cand_match> &result,
-			     const bit_array &other_w, const bit_array &other_b, const bit_array &other_caps,
-			     unsigned other_sz_x, unsigned other_sz_y) const
+/* Compute the range of offsets at which the pattern can be placed on a board
+   of size OTHER_SZ_X and OTHER_SZ_Y, taking its alignment into account.
+   Returns false if it does not fit at all.  */
+bool go_pattern::placements (unsigned other_sz_x, unsigned other_sz_y,
+			     unsigned &min_offx, unsigned &max_offx, unsigned &min_offy, unsigned &max_offy) const
 {
 	if (m_sz_x > other_sz_x || m_sz_y > other_sz_y)
-		return;
+		return false;
 
-	unsigned min_offx = 0, min_offy = 0;
-	unsigned max_offx = other_sz_x - m_sz_x + 1;
-	unsigned max_offy = other_sz_y - m_sz_y + 1;
+	min_offx = 0;
+	min_offy = 0;
+	max_offx = other_sz_x - m_sz_x + 1;
+	max_offy = other_sz_y - m_sz_y + 1;
 	/* Order matters for the following tests.  */
 	if (m_align.right)
 		min_offx = max_offx - 1;
@@ -296,7 +301,29 @@ void go_pattern::find_cands (std::vector<cand_match> &result,
 		max_offx = 1;
 	if (m_align.top)
 		max_offy = 1;
-	if (min_offx > max_offx)
+	return min_offx <= max_offx;
+}
+
+/* Set the bits in W and B for the white and black stones of the pattern, placed
+   at XOFF and YOFF on a board that is OTHER_SZ_X wide.  */
+void go_pattern::board_masks (unsigned other_sz_x, unsigned xoff, unsigned yoff, bit_array &w, bit_array &b) const
+{
+	for (unsigned y = 0; y < m_sz_y; y++)
+		for (unsigned x = 0; x < m_sz_x; x++) {
+			unsigned bitpos = (yoff + y) * other_sz_x + xoff + x;
+			if (m_lines[y].bits[0] & (1 << x))
+				w.set_bit (bitpos);
+			if (m_lines[y].bits[1] & (1 << x))
+				b.set_bit (bitpos);
+		}
+}
+
+void go_pattern::find_cands (std::vector<cand_match> &result,
+			     const bit_array &other_w, const bit_array &other_b, const bit_array &other_caps,
+			     unsigned other_sz_x, unsigned other_sz_y) const
+{
+	unsigned min_offx, max_offx, min_offy, max_offy;
+	if (!placements (other_sz_x, other_sz_y, min_offx, max_offx, min_offy, max_offy))
 		return;
 
 	bool is_empty = n_bits () == 0;
@@ -345,7 +372,7 @@ void go_pattern::find_cands (std::vector<cand_match> &result,
 	}
 }
 
-static void match_movelist (const std::vector<char> &moves, std::vector<cand_match> &cands,
+static void match_movelist (movelist_decoder moves, std::vector<cand_match> &cands,
 			    std::vector<gamedb_model::cont_bw> &conts, int cont_maxx,
 			    std::array<int, 2> &match_count)
 {
@@ -369,11 +396,8 @@ static void match_movelist (const std::vector<char> &moves, std::vector<cand_mat
 	};
 	std::vector<branch_data> stack;
 
-	size_t len = moves.size ();
-	for (size_t i = 0; i + 1 < len; i += 2) {
-		int x = moves[i];
-		int y = moves[i + 1];
-
+	int x, y;
+	while (moves.next (x, y)) {
 		if (x & db_mv_flag_branch) {
 			/* Never fully trust input data on disk, and limit the impact of
 			   bogus values.  */
@@ -445,56 +469,209 @@ static void match_movelist (const std::vector<char> &moves, std::vector<cand_mat
 	}
 }
 
+/* Return the movelist of database game ENTRY and store its length in LEN.  It is
+   found in the mapped database file, in a cached copy, or read from the database
+   file into BUF.  Returns nullptr if it could not be read.  */
+static const char *fetch_movelist (const gamedb_entry &entry, std::vector<char> &buf, size_t &len)
+{
+	if (entry.movelist_map != nullptr) {
+		len = entry.movelist_len;
+		return entry.movelist_map;
+	}
+	if (entry.movelist.size () > 0) {
+		len = entry.movelist.size ();
+		return entry.movelist.data ();
+	}
+
+	QDir dbdir = db_data->str (entry.dirname);
+	size_t off = entry.movelist_off;
+	QFile f (dbdir.filePath (off & 1 ? "q5go.db" : "kombilo.da"));
+	if (!f.exists ())
+		return nullptr;
+	f.open (QIODevice::ReadOnly);
+	f.seek (off >> 1);
+	QDataStream ds (&f);
+	/* The following contortions are required because Kombilo uses plain int
+	   in the file format (which could be any size), while we use the specific
+	   uint32_t for q5go.db.  */
+	int i_len;
+	uint32_t u_len;
+	char i_c[std::max (sizeof i_len, sizeof u_len)];
+	int len_sz = off & 1 ? sizeof u_len : sizeof i_len;
+	if (ds.readRawData (i_c, len_sz) != len_sz)
+		return nullptr;
+	if (off & 1) {
+		memcpy (&u_len, i_c, sizeof u_len);
+		i_len = u_len;
+	} else
+		memcpy (&i_len, i_c, sizeof i_len);
+	buf.resize (i_len);
+	if (ds.readRawData (&buf[0], i_len) != i_len)
+		return nullptr;
+	len = i_len;
+	return buf.data ();
+}
+
+/* The stones a pattern requires at one placement on the board, as full-board
+   bitmaps reduced to the elements that have any bits set.  */
+struct finalpos_mask
+{
+	struct elt
+	{
+		unsigned idx;
+		uint64_t w, b;
+	};
+	std::vector<elt> elts;
+};
+
+/* Don't prefilter patterns that can be placed in more ways than this.  Testing
+   all the masks would then take longer than find_cands, which gives up early
+   for most games.  */
+static const size_t max_prefilter_masks = 128;
+
+/* Build the masks for all placements of PATS, with colors as given and swapped,
+   on the board size of store S.  Returns false if there are too many.  */
+static bool prefilter_masks (const std::vector<go_pattern> &pats, const finalpos_store &s,
+			     std::vector<finalpos_mask> &masks)
+{
+	for (auto &p: pats) {
+		unsigned min_offx, max_offx, min_offy, max_offy;
+		if (!p.placements (s.sz_x, s.sz_y, min_offx, max_offx, min_offy, max_offy))
+			continue;
+		size_t n = (size_t)(max_offx - min_offx) * (max_offy - min_offy) * 2;
+		if (masks.size () + n > max_prefilter_masks)
+			return false;
+		for (unsigned yoff = min_offy; yoff < max_offy; yoff++)
+			for (unsigned xoff = min_offx; xoff < max_offx; xoff++) {
+				bit_array w (s.sz_x * s.sz_y);
+				bit_array b (s.sz_x * s.sz_y);
+				p.board_masks (s.sz_x, xoff, yoff, w, b);
+				finalpos_mask m, m_swapped;
+				for (unsigned k = 0; k < s.n_elts; k++) {
+					uint64_t wk = w.raw_bits ()[k];
+					uint64_t bk = b.raw_bits ()[k];
+					if ((wk | bk) == 0)
+						continue;
+					m.elts.push_back ({ k, wk, bk });
+					m_swapped.elts.push_back ({ k, bk, wk });
+				}
+				masks.push_back (std::move (m));
+				masks.push_back (std::move (m_swapped));
+			}
+	}
+	return true;
+}
+
+/* The filtering kernel: set PASS for those games in [FIRST, END) of store S
+   whose final position has the stones of at least one of MASKS.  Games are
+   processed in blocks, with every mask tested against a whole block at once
+   in loops the compiler can vectorize.  */
+static void prefilter_games (const finalpos_store &s, const std::vector<finalpos_mask> &masks,
+			     size_t first, size_t end, std::vector<char> &pass)
+{
+	const size_t block = 256;
+	unsigned char ok[block], any[block];
+	size_t n = s.games.size ();
+	for (size_t g0 = first; g0 < end; g0 += block) {
+		size_t len = std::min (block, end - g0);
+		std::fill (any, any + len, 0);
+		for (auto &m: masks) {
+			std::fill (ok, ok + len, 1);
+			for (auto &e: m.elts) {
+				const uint64_t *cw = &s.w[e.idx * n + g0];
+				const uint64_t *cb = &s.b[e.idx * n + g0];
+				uint64_t mw = e.w;
+				uint64_t mb = e.b;
+				for (size_t i = 0; i < len; i++)
+					ok[i] &= ((cw[i] & mw) == mw) & ((cb[i] & mb) == mb);
+			}
+			for (size_t i = 0; i < len; i++)
+				any[i] |= ok[i];
+		}
+		for (size_t i = 0; i < len; i++)
+			if (any[i])
+				pass[s.games[g0 + i]] = 1;
+	}
+}
+
+class Prefilter : public QRunnable
+{
+	const finalpos_store &m_store;
+	const std::vector<finalpos_mask> &m_masks;
+	size_t m_first, m_end;
+	std::vector<char> &m_pass;
+	QSemaphore *m_sem;
+
+public:
+	Prefilter (const finalpos_store &s, const std::vector<finalpos_mask> &m, size_t first, size_t end,
+		   std::vector<char> &pass, QSemaphore *sem)
+		: m_store (s), m_masks (m), m_first (first), m_end (end), m_pass (pass), m_sem (sem)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		prefilter_games (m_store, m_masks, m_first, m_end, m_pass);
+		m_sem->release ();
+	}
+};
+
+/* The first phase of a pattern search.  Returns a vector that is nonzero for
+   the games that could contain one of PATS, judging by their final positions.  */
+static std::vector<char> prefilter (const std::vector<go_pattern> &pats, QThreadPool &pool)
+{
+	std::vector<char> pass (db_data->m_all_entries.size (), 0);
+	const std::vector<finalpos_store> &stores = db_data->finalpos_stores ();
+	std::vector<std::vector<finalpos_mask>> masks (stores.size ());
+	QSemaphore completion_sem (0);
+	int n_started = 0;
+	for (size_t i = 0; i < stores.size (); i++) {
+		const finalpos_store &s = stores[i];
+		if (!prefilter_masks (pats, s, masks[i])) {
+			for (auto g: s.games)
+				pass[g] = 1;
+			continue;
+		}
+		if (masks[i].empty ())
+			continue;
+		/* Multiples of the block size in prefilter_games.  */
+		size_t steps = 16384;
+		for (size_t first = 0; first < s.games.size (); first += steps) {
+			size_t end = std::min (s.games.size (), first + steps);
+			pool.start (new Prefilter (s, masks[i], first, end, pass, &completion_sem));
+			n_started++;
+		}
+	}
+	completion_sem.acquire (n_started);
+	return pass;
+}
+
 std::vector<std::array<int, 2>> match_games (const std::vector<unsigned> &cand_games, size_t first, size_t end,
-				 const std::vector<go_pattern> &patterns,
+				 const std::vector<go_pattern> &patterns, const std::vector<char> &pass,
 				 std::vector<gamedb_model::cont_bw> &conts, int cont_maxx)
 {
 	std::vector<std::array<int, 2>> result (end - first);
 	std::vector<char> movelist;
 	std::vector<cand_match> cand_matches;
 	cand_matches.reserve (500);
+	bit_array caps_scratch (0);
 	for (size_t j = first; j < end; j++) {
 		unsigned g_idx = cand_games[j];
+		if (!pass[g_idx])
+			continue;
 		auto &entry = db_data->m_all_entries[g_idx];
+		const bit_array &caps = entry.final_caps (caps_scratch);
 		cand_matches.clear ();
 		for (const auto &pat: patterns)
-			pat.find_cands (cand_matches, entry.finalpos_w, entry.finalpos_b, entry.finalpos_c,
+			pat.find_cands (cand_matches, entry.finalpos_w, entry.finalpos_b, caps,
 					entry.sz_x, entry.sz_y);
 		if (cand_matches.size () == 0)
 			continue;
-		if (entry.movelist.size () > 0) {
-			match_movelist (entry.movelist, cand_matches, conts, cont_maxx,
-					result[j - first]);
-			continue;
-		}
-		QDir dbdir = entry.dirname;
-		size_t off = entry.movelist_off;
-		QFile f (dbdir.filePath (off & 1 ? "q5go.db" : "kombilo.da"));
-		if (f.exists ()) {
-			f.open (QIODevice::ReadOnly);
-			f.seek (off >> 1);
-			QDataStream ds (&f);
-			/* The following contortions are required because Kombilo uses plain int
-			   in the file format (which could be any size), while we use the specific
-			   uint32_t for q5go.db.  */
-			int len;
-			uint32_t u_len;
-			char i_c[std::max (sizeof len, sizeof u_len)];
-			int len_sz = off & 1 ? sizeof u_len : sizeof len;
-			if (ds.readRawData (i_c, len_sz) == len_sz) {
-				if (off & 1) {
-					memcpy (&u_len, i_c, sizeof u_len);
-					len = u_len;
-				} else
-					memcpy (&len, i_c, sizeof len);
-				movelist.resize (len);
-				if (ds.readRawData (&movelist[0], len) == len) {
-					match_movelist (movelist, cand_matches, conts, cont_maxx,
-							result[j - first]);
-				}
-			}
-			f.close ();
-		}
+		size_t len;
+		const char *moves = fetch_movelist (entry, movelist, len);
+		if (moves != nullptr)
+			match_movelist (movelist_decoder (moves, len, entry.movelist_packed, entry.sz_x, entry.sz_y),
+					cand_matches, conts, cont_maxx, result[j - first]);
 	}
 	return result;
 }
@@ -504,6 +681,7 @@ class PartialSearch : public QRunnable
 {
 	std::vector<go_pattern> m_pats;
 	std::vector<unsigned> *m_entries;
+	const std::vector<char> *m_pass;
 	QMutex *m_mutex;
 	QSemaphore *m_sem;
 	std::vector<std::array<int, 2>> *m_result;
@@ -513,11 +691,11 @@ class PartialSearch : public QRunnable
 	int m_cont_sz_x;
 
 public:
-	PartialSearch (std::vector<unsigned> *e, int start, int end,
+	PartialSearch (std::vector<unsigned> *e, const std::vector<char> *pass, int start, int end,
 		       const std::vector<go_pattern> &p, std::vector<std::array<int, 2>> *r,
 		       std::vector<gamedb_model::cont_bw> *c, QMutex *m, QSemaphore *s,
 		       std::atomic<long> *count)
-		: m_pats (p), m_entries (e), m_mutex (m), m_sem (s), m_result (r), m_conts (c),
+		: m_pats (p), m_entries (e), m_pass (pass), m_mutex (m), m_sem (s), m_result (r), m_conts (c),
 		  m_pcur (count), m_first (start), m_end (end)
 	{
 		m_cont_sz_x = p[0].sz_x ();
@@ -526,7 +704,8 @@ public:
 	void run () override
 	{
 		std::vector<gamedb_model::cont_bw> continuations (m_pats[0].sz_y () * m_pats[0].sz_x ());
-		std::vector<std::array<int, 2>> games = match_games (*m_entries, m_first, m_end, m_pats, continuations, m_cont_sz_x);
+		std::vector<std::array<int, 2>> games = match_games (*m_entries, m_first, m_end, m_pats, *m_pass,
+								     continuations, m_cont_sz_x);
 		{
 			QMutexLocker lock (m_mutex);
 			for (size_t i = m_first; i < m_end; i++) {
@@ -595,6 +774,9 @@ std::vector<go_pattern> identical_symmetries (const go_pattern &p0)
    spots where the pattern could match, just based on which color stones have been on any given position during
    a game.  We then verify the candidates against the saved move list, identifying real matches and their
    continuations.
+   Before that, a quick first phase tests the final positions of many games at once against full-board masks
+   of the pattern's stones, when the pattern can only be placed in a limited number of ways (for example,
+   when it is anchored to a corner).
    Threading is used to search the eight symmetries in parallel.  */
 
 gamedb_model::search_result
@@ -609,11 +791,12 @@ gamedb_model::find_pattern (const go_pattern &p0, std::atomic<long> *cur, std::a
 	QSemaphore completion_sem (0);
 	QThreadPool pool;
 	max->store (m_entries.size ());
+	std::vector<char> pass = prefilter (pats, pool);
 	int n_started = 0;
 	size_t steps = std::max ((size_t)10, m_entries.size () / 128);
 	for (size_t i = 0; i < m_entries.size (); i += steps) {
 		size_t end = std::min (m_entries.size (), i + steps);
-		pool.start (new PartialSearch (&m_entries, i, end, pats, &result, &continuations,
+		pool.start (new PartialSearch (&m_entries, &pass, i, end, pats, &result, &continuations,
 					       &result_mutex, &completion_sem, cur));
 		n_started++;
 	}
@@ -642,25 +825,310 @@ gamedb_model::find_pattern (const go_pattern &p0, std::atomic<long> *cur, std::a
 	return std::pair <std::vector<std::array<int, 2>>, std::vector<gamedb_model::cont_bw>> { std::move (result), std::move (continuations) };
 }
 
+static bool match_any (const std::vector<go_pattern> &pats, const game_state *st, board_rect &sel_return)
+{
+	const go_board &b = st->get_board ();
+	const bit_array &sw = b.get_stones_w ();
+	const bit_array &sb = b.get_stones_b ();
+	for (auto &p: pats)
+		if (p.match (sw, sb, b.size_x (), b.size_y (), sel_return))
+			return true;
+	return false;
+}
+
+/* Searching within a single game.  These use the parallel tree search, which
+   matters for large review files with many variations.  */
+
 game_state *find_first_match (go_game_ptr gr, const go_pattern &p0, board_rect &sel_return)
 {
 	std::vector<go_pattern> pats = unique_symmetries (p0);
 
-	auto callback = [&pats, &sel_return] (game_state *st) -> bool
+	game_state *st = gr->get_root ()->find_first ([&pats] (const game_state *st) -> bool
+						      {
+							      board_rect r;
+							      return match_any (pats, st, r);
+						      });
+	if (st != nullptr)
+		match_any (pats, st, sel_return);
+	return st;
+}
+
+std::vector<std::pair<game_state *, board_rect>> find_all_matches (go_game_ptr gr, const go_pattern &p0)
+{
+	std::vector<go_pattern> pats = unique_symmetries (p0);
+
+	std::vector<game_state *> found = gr->get_root ()->find_all ([&pats] (const game_state *st) -> bool
+								     {
+									     board_rect r;
+									     return match_any (pats, st, r);
+								     });
+	std::vector<std::pair<game_state *, board_rect>> result;
+	for (auto st: found) {
+		board_rect r;
+		match_any (pats, st, r);
+		result.emplace_back (st, r);
+	}
+	return result;
+}
+
+/* Opening trees.  These merge the beginnings of many database games into a single game
+   record, with the number of games and their results recorded in each node's comment.  */
+
+struct db_move
+{
+	unsigned char x, y;
+};
+
+/* Extract up to N_MOVES moves of the main line from database movelist LIST.  The first
+   child of a node is stored inside the first branch of the list, so the main line ends
+   at the first end-of-variation marker.  Extraction stops at passes, edits and moves out
+   of turn.  Returns false for games starting from a setup position, since those can't
+   share a tree with games played from an empty board.  */
+static bool main_line_moves (movelist_decoder list, size_t n_moves, unsigned size,
+			     std::vector<db_move> &moves)
+{
+	int n_added = 0;
+	db_move added {};
+	stone_color added_col = none;
+	bool at_root = true;
+
+	int x, y;
+	while (moves.size () < n_moves && list.next (x, y)) {
+		if (x & db_mv_flag_branch)
+			continue;
+		if (x & db_mv_flag_endvar)
+			break;
+		if ((y & (db_mv_flag_black | db_mv_flag_white)) != 0 && (y & db_mv_flag_delete) == 0) {
+			n_added++;
+			added = { (unsigned char)(x & 31), (unsigned char)(y & 31) };
+			added_col = y & db_mv_flag_black ? black : white;
+		}
+		if (x & db_mv_flag_node_end) {
+			/* The root node is always encoded, even when it is empty.  */
+			if (at_root) {
+				if (n_added > 0)
+					return false;
+				at_root = false;
+				continue;
+			}
+			stone_color expected = moves.size () % 2 == 0 ? black : white;
+			if (n_added != 1 || added_col != expected || added.x >= size || added.y >= size)
+				return true;
+			moves.push_back (added);
+			n_added = 0;
+		}
+	}
+	return true;
+}
+
+/* Transform MOVES into a canonical orientation, so that games which differ only by a
+   board symmetry produce the same sequence.  We pick the symmetry which places the
+   earliest move that distinguishes them nearest to the upper right corner.  */
+static void canonicalize_moves (std::vector<db_move> &moves, unsigned size)
+{
+	static const coord_transform transforms[] = {
+		coord_transform_none::transform, coord_transform_r90::transform,
+		coord_transform_r180::transform, coord_transform_r270::transform,
+		coord_transform_flip1::transform, coord_transform_flip2::transform,
+		coord_transform_flip3::transform, coord_transform_flip4::transform
+	};
+	std::vector<coord_transform> cands (std::begin (transforms), std::end (transforms));
+	std::vector<coord_transform> next;
+	for (auto &m: moves) {
+		if (cands.size () == 1)
+			break;
+		unsigned best = size * size;
+		next.clear ();
+		for (auto t: cands) {
+			unsigned x, y;
+			std::tie (x, y) = t (m.x, m.y, size, size);
+			unsigned key = y * size + size - 1 - x;
+			if (key < best) {
+				best = key;
+				next.clear ();
+			}
+			if (key == best)
+				next.push_back (t);
+		}
+		std::swap (cands, next);
+	}
+	coord_transform t = cands[0];
+	for (auto &m: moves) {
+		unsigned x, y;
+		std::tie (x, y) = t (m.x, m.y, size, size);
+		m.x = x;
+		m.y = y;
+	}
+}
+
+class OpeningExtract : public QRunnable
+{
+	const std::vector<unsigned> *m_games;
+	std::vector<std::vector<db_move>> *m_result;
+	std::vector<char> *m_usable;
+	QSemaphore *m_sem;
+	size_t m_first, m_end;
+	size_t m_n_moves;
+	unsigned m_size;
+
+public:
+	OpeningExtract (const std::vector<unsigned> *g, size_t first, size_t end, size_t n_moves, unsigned size,
+			std::vector<std::vector<db_move>> *r, std::vector<char> *u, QSemaphore *s)
+		: m_games (g), m_result (r), m_usable (u), m_sem (s), m_first (first), m_end (end),
+		  m_n_moves (n_moves), m_size (size)
+	{
+		setAutoDelete (true);
+	}
+	void run () override
+	{
+		std::vector<char> buf;
+		for (size_t j = m_first; j < m_end; j++) {
+			const gamedb_entry &entry = db_data->m_all_entries[(*m_games)[j]];
+			if (entry.sz_x != (int)m_size || entry.sz_y != (int)m_size)
+				continue;
+			size_t len;
+			const char *list = fetch_movelist (entry, buf, len);
+			if (list == nullptr)
+				continue;
+			std::vector<db_move> &moves = (*m_result)[j];
+			if (!main_line_moves (movelist_decoder (list, len, entry.movelist_packed, m_size, m_size),
+					      m_n_moves, m_size, moves))
+				continue;
+			canonicalize_moves (moves, m_size);
+			(*m_usable)[j] = 1;
+		}
+		m_sem->release ();
+	}
+};
+
+/* The main entry point for building opening trees.  GAMES are indices into the database,
+   and only games of the most common square board size among them are used.  Moves are
+   first merged into a compact trie, keyed by a hash of parent node and move, and only
+   then turned into game_states for the nodes reached by at least MIN_GAMES games.  */
+
+go_game_ptr build_opening_tree (const std::vector<unsigned> &games, int n_moves, int min_games)
+{
+	std::map<int, size_t> size_counts;
+	for (auto g: games) {
+		const gamedb_entry &entry = db_data->m_all_entries[g];
+		if (entry.sz_x == entry.sz_y)
+			size_counts[entry.sz_x]++;
+	}
+	if (size_counts.empty ())
+		return nullptr;
+	auto best_size = std::max_element (std::begin (size_counts), std::end (size_counts),
+					   [] (const std::pair<const int, size_t> &a, const std::pair<const int, size_t> &b)
+					   {
+						   return a.second < b.second;
+					   });
+	unsigned size = best_size->first;
+
+	std::vector<std::vector<db_move>> game_moves (games.size ());
+	std::vector<char> usable (games.size ());
 	{
-		const go_board &b = st->get_board ();
-		const bit_array &sw = b.get_stones_w ();
-		const bit_array &sb = b.get_stones_b ();
-		for (auto &p: pats)
-			if (p.match (sw, sb, b.size_x (), b.size_y (), sel_return))
-				throw st;
-		return true;
+		QSemaphore completion_sem (0);
+		QThreadPool pool;
+		int n_started = 0;
+		size_t steps = std::max ((size_t)64, games.size () / 128);
+		for (size_t i = 0; i < games.size (); i += steps) {
+			size_t end = std::min (games.size (), i + steps);
+			pool.start (new OpeningExtract (&games, i, end, n_moves, size, &game_moves, &usable, &completion_sem));
+			n_started++;
+		}
+		completion_sem.acquire (n_started);
+	}
 
+	struct trie_node
+	{
+		db_move mv;
+		int parent;
+		unsigned count = 0, b_wins = 0, w_wins = 0;
+		std::vector<int> children;
+		trie_node (db_move m, int p) : mv (m), parent (p) { }
 	};
-	try {
-		gr->get_root ()->walk_tree (callback);
-	} catch (game_state *st) {
-		return st;
+	std::vector<trie_node> trie;
+	trie.emplace_back (db_move { 0, 0 }, -1);
+	std::unordered_map<uint64_t, int> child_map;
+
+	size_t n_games = 0;
+	for (size_t j = 0; j < games.size (); j++) {
+		if (!usable[j])
+			continue;
+		n_games++;
+		const QString &res = db_data->str (db_data->m_all_entries[games[j]].result);
+		bool b_win = res.startsWith ('B');
+		bool w_win = res.startsWith ('W');
+		int cur = 0;
+		for (size_t k = 0;; k++) {
+			trie_node &n = trie[cur];
+			n.count++;
+			n.b_wins += b_win;
+			n.w_wins += w_win;
+			if (k == game_moves[j].size ())
+				break;
+			const db_move &m = game_moves[j][k];
+			uint64_t key = ((uint64_t)cur << 16) | (m.x << 8) | m.y;
+			auto it = child_map.find (key);
+			if (it != child_map.end ())
+				cur = it->second;
+			else {
+				int idx = trie.size ();
+				child_map.emplace (key, idx);
+				trie[cur].children.push_back (idx);
+				trie.emplace_back (m, cur);
+				cur = idx;
+			}
+		}
+		std::vector<db_move> ().swap (game_moves[j]);
+	}
+	if (n_games == 0)
+		return nullptr;
+
+	size_t n_nodes = 0;
+	for (auto &n: trie)
+		if (n.count >= (unsigned)min_games)
+			n_nodes++;
+
+	game_info info;
+	info.title = QObject::tr ("Opening tree (%1 games)").arg (n_games).toStdString ();
+	go_game_ptr gr = std::make_shared<game_record> (size, info);
+	gr->reserve (n_nodes);
+
+	auto stats_comment = [] (const trie_node &n) -> std::string
+		{
+			auto percent = [&n] (unsigned v) { return QString::number (100. * v / n.count, 'f', 1); };
+			QString s = QObject::tr ("Games: %1\nBlack wins: %2 (%3%)\nWhite wins: %4 (%5%)")
+				.arg (n.count).arg (n.b_wins).arg (percent (n.b_wins))
+				.arg (n.w_wins).arg (percent (n.w_wins));
+			return s.toStdString ();
+		};
+
+	std::vector<std::pair<int, game_state *>> stack;
+	stack.emplace_back (0, gr->get_root ());
+	while (!stack.empty ()) {
+		int idx = stack.back ().first;
+		game_state *st = stack.back ().second;
+		stack.pop_back ();
+		trie_node &n = trie[idx];
+		st->set_comment (stats_comment (n));
+
+		/* The most frequently played continuation becomes the main line.  */
+		std::vector<int> &cld = n.children;
+		std::stable_sort (std::begin (cld), std::end (cld),
+				  [&trie] (int a, int b) { return trie[a].count > trie[b].count; });
+		bool first = true;
+		for (auto c: cld) {
+			const trie_node &child = trie[c];
+			if (child.count < (unsigned)min_games)
+				break;
+			go_board new_board (st->get_board (), mark::none);
+			new_board.add_stone (child.mv.x, child.mv.y, st->to_move ());
+			game_state *new_st = st->add_child_move_nochecks (new_board, st->to_move (), child.mv.x, child.mv.y,
+									  first ? game_state::add_mode::set_active
+									  : game_state::add_mode::keep_active);
+			first = false;
+			stack.emplace_back (c, new_st);
+		}
 	}
-	return nullptr;
+	return gr;
 }
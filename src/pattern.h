@@ -48,6 +48,9 @@ public:
 	void find_cands (std::vector<cand_match> &,
 			 const bit_array &other_w, const bit_array &other_b, const bit_array &other_caps,
 			 unsigned other_sz_x, unsigned other_sz_y) const;
+	bool placements (unsigned other_sz_x, unsigned other_sz_y,
+			 unsigned &min_offx, unsigned &max_offx, unsigned &min_offy, unsigned &max_offy) const;
+	void board_masks (unsigned other_sz_x, unsigned xoff, unsigned yoff, bit_array &w, bit_array &b) const;
 	coord_transform reverse () const { return m_reverse; }
 };
 
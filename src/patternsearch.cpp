@@ -50,6 +50,7 @@ PatternSearchWindow::PatternSearchWindow ()
 	connect (ui->resetAll, &QAction::triggered, [this] ()
 		 {
 			 m_model.reset_filters ();
+			 clear_matches ();
 			 m_game = m_orig_game;
 			 ui->boardView->reset_game (m_game);
 			 clear_preview_cursor ();
@@ -75,6 +76,8 @@ PatternSearchWindow::PatternSearchWindow ()
 	connect (ui->navLast, &QAction::triggered, this, &PatternSearchWindow::nav_goto_last_move);
 	connect (ui->editDelete, &QAction::triggered, this, &PatternSearchWindow::editDelete);
 	connect (ui->navGotoCont, &QAction::triggered, this, &PatternSearchWindow::nav_goto_cont);
+	connect (ui->navNextMatch, &QAction::triggered, this, &PatternSearchWindow::nav_next_match);
+	connect (ui->navPrevMatch, &QAction::triggered, this, &PatternSearchWindow::nav_previous_match);
 	connect (ui->boardView, &SimpleBoard::signal_nav_forward, this, &PatternSearchWindow::nav_next_move);
 	connect (ui->boardView, &SimpleBoard::signal_nav_backward, this, &PatternSearchWindow::nav_previous_move);
 
@@ -309,6 +312,7 @@ void PatternSearchWindow::update_caption ()
 void PatternSearchWindow::preview_clicked (const preview &p)
 {
 	apply_game_result (p.games_result);
+	clear_matches ();
 	m_game = p.game;
 	ui->boardView->reset_game (p.game);
 	ui->boardView->set_displayed (p.state);
@@ -360,6 +364,9 @@ void PatternSearchWindow::update_actions ()
 	ui->navLast->setEnabled (st->n_children () > 0);
 	ui->navFirst->setEnabled (!st->root_node_p ());
 	ui->navBackward->setEnabled (!st->root_node_p ());
+	ui->navNextMatch->setEnabled (m_matches.size () > 0
+				      && (!m_matches_complete || m_match_idx + 1 < m_matches.size ()));
+	ui->navPrevMatch->setEnabled (m_match_idx > 0);
 }
 
 void PatternSearchWindow::slot_choose_view (bool)
@@ -386,6 +393,7 @@ void PatternSearchWindow::editDelete ()
 
 	game_state *parent = st->prev_move ();
 	ui->boardView->set_displayed (parent);
+	clear_matches ();
 	st->disconnect ();
 	update_actions ();
 }
@@ -454,6 +462,71 @@ void PatternSearchWindow::nav_goto_cont ()
 	update_actions ();
 }
 
+void PatternSearchWindow::clear_matches ()
+{
+	m_matches.clear ();
+	m_match_idx = 0;
+	m_matches_complete = false;
+}
+
+/* Display match number IDX, with the next few moves played inside the
+   matched area numbered on the board.  */
+void PatternSearchWindow::show_match (size_t idx)
+{
+	m_match_idx = idx;
+	game_state *st = m_matches[idx].first;
+	const board_rect &sel_rect = m_matches[idx].second;
+	const go_board &b = st->get_board ();
+	ui->boardView->set_displayed (st);
+	ui->boardView->set_selection (sel_rect);
+	m_game_cont.clear ();
+	m_game_cont.resize (b.bitsize ());
+	int count = 1;
+	for (;;) {
+		st = st->next_move ();
+		if (st == nullptr || !st->was_move_p ())
+			break;
+		int x = st->get_move_x ();
+		int y = st->get_move_y ();
+		stone_color col = st->get_move_color ();
+		if (!sel_rect.contained (x, y))
+			continue;
+		unsigned bp = b.bitpos (x, y);
+		if (m_game_cont[bp].get (none).count != 0)
+			break;
+		m_game_cont[bp].get (none).count = count;
+		m_game_cont[bp].get (col).count = count;
+		count++;
+		if (count > 5)
+			break;
+	}
+	ui->boardView->set_cont_data (&m_game_cont);
+	ui->boardView->set_cont_view (pattern_cont_view::numbers);
+	update_actions ();
+}
+
+void PatternSearchWindow::nav_next_match ()
+{
+	if (m_matches.size () == 0 || last_pattern == nullptr)
+		return;
+	if (!m_matches_complete) {
+		/* The parallel search returns matches in the same order as
+		   find_first_match, so the current index stays valid.  */
+		m_matches = find_all_matches (m_game, *last_pattern);
+		m_matches_complete = true;
+	}
+	if (m_match_idx + 1 < m_matches.size ())
+		show_match (m_match_idx + 1);
+	else
+		update_actions ();
+}
+
+void PatternSearchWindow::nav_previous_match ()
+{
+	if (m_match_idx > 0)
+		show_match (m_match_idx - 1);
+}
+
 void PatternSearchWindow::update_selection ()
 {
 	QFontMetrics m (setting->fontStandard);
@@ -472,13 +545,14 @@ void PatternSearchWindow::update_selection ()
 
 	QModelIndex i = selected.first ();
 	const gamedb_entry &e = m_model.find (i.row ());
-	QString s1 = e.pw + " - " + e.pb;
-	if (!e.result.isEmpty ())
-		s1 += ", " + e.result;
-	QString s2 = e.event;
+	QString s1 = db_data->str (e.pw) + " - " + db_data->str (e.pb);
+	const QString &result = db_data->str (e.result);
+	if (!result.isEmpty ())
+		s1 += ", " + result;
+	QString s2 = db_data->str (e.event);
 	if (!s2.isEmpty ())
 		s2 += ", ";
-	s2 += e.date;
+	s2 += db_data->str (e.date);
 	/* Using labels seems like the natural way to do this, but they scale according to their
 	   contents, changing the layout of the entire window, which is undesirable.  */
 	m_info_scene->addSimpleText (s1, setting->fontStandard);
@@ -601,10 +675,10 @@ go_game_ptr PatternSearchWindow::load_selected ()
 	QModelIndex i = selected.first ();
 	const gamedb_entry &e = m_model.find (i.row ());
 	last_loaded = &e;
-	QDir d (e.dirname);
-	QString filename = d.filePath (e.filename);
+	QDir d (db_data->str (e.dirname));
+	QString filename = d.filePath (db_data->str (e.filename));
 	qDebug () << filename;
-	return record_from_file (filename, nullptr);
+	return record_from_file (filename, nullptr, e.game_idx);
 }
 
 void PatternSearchWindow::handle_doubleclick ()
@@ -613,6 +687,7 @@ void PatternSearchWindow::handle_doubleclick ()
 	if (new_gr == nullptr)
 		return;
 	clear_preview_cursor ();
+	clear_matches ();
 	m_game = new_gr;
 	ui->boardView->reset_game (new_gr);
 	update_caption ();
@@ -620,32 +695,8 @@ void PatternSearchWindow::handle_doubleclick ()
 		board_rect sel_rect;
 		game_state *st = find_first_match (new_gr, *last_pattern, sel_rect);
 		if (st) {
-			const go_board &b = st->get_board ();
-			ui->boardView->set_displayed (st);
-			ui->boardView->set_selection (sel_rect);
-			m_game_cont.clear ();
-			m_game_cont.resize (b.bitsize ());
-			int count = 1;
-			for (;;) {
-				st = st->next_move ();
-				if (st == nullptr || !st->was_move_p ())
-					break;
-				int x = st->get_move_x ();
-				int y = st->get_move_y ();
-				stone_color col = st->get_move_color ();
-				if (!sel_rect.contained (x, y))
-					continue;
-				unsigned bp = b.bitpos (x, y);
-				if (m_game_cont[bp].get (none).count != 0)
-					break;
-				m_game_cont[bp].get (none).count = count;
-				m_game_cont[bp].get (col).count = count;
-				count++;
-				if (count > 5)
-					break;
-			}
-			ui->boardView->set_cont_data (&m_game_cont);
-			ui->boardView->set_cont_view (pattern_cont_view::numbers);
+			m_matches.emplace_back (st, sel_rect);
+			show_match (0);
 		}
 	}
 	update_actions ();
@@ -784,6 +835,7 @@ void PatternSearchWindow::pattern_search (bool all_games)
 
 	delete last_pattern;
 	last_pattern = new go_pattern (p);
+	clear_matches ();
 	db_data->db_mutex.lock ();
 	ui->progressBar->reset ();
 	m_progress_timer = startTimer (200);
@@ -799,6 +851,7 @@ void PatternSearchWindow::timerEvent (QTimerEvent *)
 
 void PatternSearchWindow::do_search (go_game_ptr gr, game_state *st, const board_rect &r)
 {
+	clear_matches ();
 	m_game = gr;
 	ui->boardView->reset_game (gr);
 	ui->boardView->set_displayed (st);
@@ -813,6 +866,7 @@ void PatternSearchWindow::slot_using ()
 	txt += tr ("<p>Select a rectangle using the right mouse button. Search in the current game list by pressing S, or in all the games by pressing A (or use the menus and icons).</p>");
 	txt += tr ("<p>Once a search is complete, click on one of the games to bring up the position where the pattern occurs. ");
 	txt += tr ("The pattern will be highlighted.  You can press N to go to the next move within that region.</p>");
+	txt += tr ("<p>When a game is opened from the list by double-clicking, it is shown at the first position that matches the pattern. Press M and Shift+M to step through all the matching positions in that game, including its variations.</p>");
 	QMessageBox mb;
 	mb.setWindowTitle (PACKAGE " " VERSION);
 	mb.setTextFormat (Qt::RichText);
@@ -76,6 +76,12 @@ class PatternSearchWindow : public QMainWindow
 	const std::vector<pattern_cont_data> *m_search_cont {};
 
 	go_pattern *last_pattern {};
+	/* Positions in m_game that match last_pattern.  Only the first one is
+	   found when a game is loaded; the rest are searched for when the user
+	   first asks for the next match.  */
+	std::vector<std::pair<game_state *, board_rect>> m_matches;
+	size_t m_match_idx = 0;
+	bool m_matches_complete = false;
 	gamedb_model::search_result *m_result {};
 	QThread search_thread;
 	search_runnable *m_runnable;
@@ -127,6 +133,8 @@ class PatternSearchWindow : public QMainWindow
 
 	void pattern_search (bool);
 	void handle_doubleclick ();
+	void show_match (size_t);
+	void clear_matches ();
 	void update_selection ();
 	void update_caption ();
 
@@ -161,6 +169,8 @@ public slots:
 	void nav_goto_first_move ();
 	void nav_goto_last_move ();
 	void nav_goto_cont ();
+	void nav_next_match ();
+	void nav_previous_match ();
 
 	void editDelete ();
 signals:
@@ -170,3 +180,4 @@ signals:
 extern PatternSearchWindow *patsearch_window;
 
 extern game_state *find_first_match (go_game_ptr, const go_pattern &, board_rect &);
+extern std::vector<std::pair<game_state *, board_rect>> find_all_matches (go_game_ptr, const go_pattern &);
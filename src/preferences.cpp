@@ -406,6 +406,7 @@ PreferencesDialog::PreferencesDialog (int tab, QWidget* parent)
 	connect (ui->dbCfgButton, &QPushButton::clicked, this, &PreferencesDialog::slot_dbcfg);
 	connect (ui->dbRemButton, &QPushButton::clicked, this, &PreferencesDialog::slot_dbrem);
 	connect (ui->dbCreateButton, &QPushButton::clicked, this, &PreferencesDialog::slot_dbcreate);
+	connect (ui->dbUpdateButton, &QPushButton::clicked, this, &PreferencesDialog::slot_dbupdate);
 
 	ui->ListView_engines->setModel (&m_engines_model);
 	connect (ui->ListView_engines, &ClickableListView::current_changed, [this] () { update_current_engine (); });
@@ -463,6 +464,7 @@ void PreferencesDialog::update_db_selection ()
 
 	ui->dbRemButton->setEnabled (selection);
 	ui->dbCreateButton->setEnabled (selection);
+	ui->dbUpdateButton->setEnabled (selection);
 }
 
 void PreferencesDialog::update_db_labels ()
@@ -616,7 +618,7 @@ void PreferencesDialog::slot_dbrem (bool)
 	update_db_labels ();
 }
 
-void PreferencesDialog::slot_dbcreate (bool)
+void PreferencesDialog::create_dbs (bool update)
 {
 	QItemSelectionModel *sel = ui->dbPathsTreeView->selectionModel ();
 	const QModelIndexList &selected = sel->selectedRows ();
@@ -625,17 +627,17 @@ void PreferencesDialog::slot_dbcreate (bool)
 	if (!selection)
 		return;
 
-	QProgressDialog dlg (tr ("Creating database from SGF files..."), tr ("Abort operation"),
-			     0, 100, this);
+	QString title = update ? tr ("Updating database from SGF files...") : tr ("Creating database from SGF files...");
+	QProgressDialog dlg (title, tr ("Abort operation"), 0, 100, this);
 	dlg.setWindowModality (Qt::WindowModal);
 	dlg.setMinimumDuration (0);
 
 	for (QModelIndex i: selected) {
 		const db_dir_entry *e = m_dbpath_model.find (i);
 		if (e) {
-			QString label = tr ("Creating database from SGF files...\nProcessing: ") + e->title;
+			QString label = title + tr ("\nProcessing: ") + e->title;
 			dlg.setLabelText (label);
-			if (create_db_for_dir (dlg, e->title)) {
+			if (create_db_for_dir (dlg, e->title, update)) {
 				db_dir_entry new_e (e->title);
 				m_dbpath_model.update_entry (i, new_e);
 				m_dbpaths_changed = true;
@@ -645,6 +647,16 @@ void PreferencesDialog::slot_dbcreate (bool)
 	update_db_labels ();
 }
 
+void PreferencesDialog::slot_dbcreate (bool)
+{
+	create_dbs (false);
+}
+
+void PreferencesDialog::slot_dbupdate (bool)
+{
+	create_dbs (true);
+}
+
 void PreferencesDialog::slot_autosavedir (bool)
 {
 	QString curr = ui->autosavePathEdit->text ();
@@ -721,6 +733,7 @@ void PreferencesDialog::init_from_settings ()
 	ui->languageComboBox->setCurrentIndex (setting->convertLanguageCodeToNumber());
 
 	ui->fileSelComboBox->setCurrentIndex (setting->readIntEntry("FILESEL"));
+	ui->lazySGFCheckBox->setChecked (setting->readBoolEntry ("SGF_LAZY"));
 
 	ui->radioButtonStones_2D->setChecked ((setting->readIntEntry("STONES_LOOK")==1));
 	ui->radioButtonStones_3D->setChecked ((setting->readIntEntry("STONES_LOOK")==2));
@@ -786,6 +799,7 @@ void PreferencesDialog::init_from_settings ()
 	ui->diagShowComboBox->setCurrentIndex (setting->readIntEntry("BOARD_DIAGMODE"));
 	ui->diagClearCheckBox->setChecked (setting->readBoolEntry("BOARD_DIAGCLEAR"));
 	ui->diagHideCheckBox->setChecked (setting->readBoolEntry("GAMETREE_DIAGHIDE"));
+	ui->transposCheckBox->setChecked (setting->readBoolEntry("GAMETREE_TRANSPOS"));
 
 	// Client Window tab
 	ui->LineEdit_watch->setText (setting->readEntry("WATCH"));
@@ -1029,6 +1043,7 @@ void PreferencesDialog::do_apply ()
 
 	setting->writeEntry ("LANG", setting->convertNumberToLanguage(ui->languageComboBox->currentIndex ()));
 	setting->writeIntEntry ("FILESEL", ui->fileSelComboBox->currentIndex ());
+	setting->writeBoolEntry ("SGF_LAZY", ui->lazySGFCheckBox->isChecked ());
 //	setting->writeBoolEntry ("STONES_SHADOW", ui->stonesShadowCheckBox->isChecked ());
 //	setting->writeBoolEntry ("STONES_SHELLS", ui->stonesShellsCheckBox->isChecked ());
 	int i = 3;
@@ -1149,6 +1164,7 @@ void PreferencesDialog::do_apply ()
 	setting->writeIntEntry ("BOARD_DIAGMODE", ui->diagShowComboBox->currentIndex ());
 	setting->writeBoolEntry ("BOARD_DIAGCLEAR", ui->diagClearCheckBox->isChecked ());
 	setting->writeBoolEntry ("GAMETREE_DIAGHIDE", ui->diagHideCheckBox->isChecked ());
+	setting->writeBoolEntry ("GAMETREE_TRANSPOS", ui->transposCheckBox->isChecked ());
 
 	setting->writeEntry ("WTITLE_MATCH", ui->titleMatchEdit->text ());
 	setting->writeEntry ("WTITLE_OBSERVE", ui->titleObserveEdit->text ());
@@ -171,7 +171,8 @@ class PreferencesDialog : public QDialog
 	void update_db_labels ();
 
 	/* Defined in gamedb.cpp.  */
-	bool create_db_for_dir (QProgressDialog &dlg, const QString &dir);
+	bool create_db_for_dir (QProgressDialog &dlg, const QString &dir, bool update);
+	void create_dbs (bool update);
 
 public:
 	PreferencesDialog (int tab, QWidget* parent = 0);
@@ -217,6 +218,7 @@ public slots:
 	void slot_dbcfg (bool);
 	void slot_dbrem (bool);
 	void slot_dbcreate (bool);
+	void slot_dbupdate (bool);
 
 private:
 	void saveSizes ();
@@ -71,6 +71,7 @@ Setting::Setting()
 	writeIntEntry ("SKIN_INDEX", default_skin_setting);
 
 	writeIntEntry("FILESEL", 1);
+	writeBoolEntry("SGF_LAZY", false);
 
 	writeBoolEntry("TOOLTIPS", true);
 	//writeBoolEntry("STONES_SHADOW", true);
@@ -136,6 +137,7 @@ Setting::Setting()
 
 	writeIntEntry ("GAMETREE_SIZE", 30);
 	writeBoolEntry ("GAMETREE_DIAGHIDE", 1);
+	writeBoolEntry ("GAMETREE_TRANSPOS", 0);
 	writeIntEntry ("BOARD_DIAGMODE", 1);
 	writeIntEntry ("BOARD_DIAGCLEAR", 1);
 	writeIntEntry ("TOROID_DUPS", 2);
@@ -515,6 +517,7 @@ void Setting::extract_frequent_settings ()
 	values.analysis_winrate = readIntEntry ("ANALYSIS_WINRATE");
 
 	values.gametree_diaghide = readBoolEntry ("GAMETREE_DIAGHIDE");
+	values.gametree_transpos = readBoolEntry ("GAMETREE_TRANSPOS");
 	values.gametree_size = readIntEntry ("GAMETREE_SIZE");
 
 	values.toroid_dups = readIntEntry ("TOROID_DUPS");
@@ -96,6 +96,7 @@ struct setting_vals
 	int analysis_winrate;
 
 	int gametree_diaghide;
+	bool gametree_transpos;
 	int gametree_size;
 
 	int toroid_dups;
@@ -3,8 +3,10 @@
 
 #include <string>
 #include <vector>
+#include <new>
 #include <exception>
 #include <memory>
+#include <cstdint>
 
 class premature_eof : public std::exception
 {
@@ -48,6 +50,82 @@ struct sgf_figure
 	std::string title;
 };
 
+/* Property identifiers the program understands.  The parser maps each
+   identifier it reads to one of these, so that lookups become integer
+   compares.  Anything else is sgf_prop::unknown and is only kept as a
+   string, to be written out again unchanged.  */
+enum class sgf_prop : unsigned char
+{
+	unknown,
+	/* Moves and setup.  */
+	B, W, AB, AW, AE, PL,
+	/* Node annotations.  */
+	C, FG, VW, PM, MN, WL, BL, OW, OB,
+	/* Marks.  */
+	MA, TR, SQ, CR, LB, TW, TB,
+	/* Root properties.  */
+	GN, PW, WR, PB, BR, KM, RU, HA, TM, OT, RE, DT, PC, EV, RO, CP, ST, AP,
+	SZ, FF, GM, CA,
+	/* Our own extensions.  */
+	TO, MASK, QLZV, QKGV,
+	n_props
+};
+
+static_assert ((int)sgf_prop::n_props <= 64, "sgf_prop must fit into a 64 bit mask");
+
+static inline uint64_t sgf_prop_bit (sgf_prop p)
+{
+	return (uint64_t)1 << (int)p;
+}
+
+extern sgf_prop sgf_intern_prop (const std::string &);
+
+/* A bump allocator for the parts of one SGF tree.  Objects are constructed in
+   large blocks and are only destroyed together with the arena.  */
+template<class T>
+class sgf_arena
+{
+	static const size_t n_per_block = 256;
+	struct block
+	{
+		T *mem;
+		size_t n_used, n_alloced;
+	};
+	std::vector<block> m_blocks;
+
+public:
+	sgf_arena () = default;
+	sgf_arena (const sgf_arena &) = delete;
+	sgf_arena &operator= (const sgf_arena &) = delete;
+	~sgf_arena ()
+	{
+		for (auto &b: m_blocks) {
+			for (size_t j = 0; j < b.n_used; j++)
+				b.mem[j].~T ();
+			::operator delete (b.mem);
+		}
+	}
+	/* Construct N objects next to each other.  */
+	T *create_n (size_t n)
+	{
+		if (m_blocks.empty () || m_blocks.back ().n_alloced - m_blocks.back ().n_used < n) {
+			size_t sz = n > n_per_block ? n : n_per_block;
+			m_blocks.push_back ({ static_cast<T *> (::operator new (sizeof (T) * sz)), 0, sz });
+		}
+		block &b = m_blocks.back ();
+		T *first = b.mem + b.n_used;
+		for (size_t i = 0; i < n; i++) {
+			new (first + i) T ();
+			b.n_used++;
+		}
+		return first;
+	}
+	T *create ()
+	{
+		return create_n (1);
+	}
+};
+
 class sgf
 {
 public:
@@ -57,36 +135,88 @@ public:
 	public:
 		node *m_children = nullptr, *m_siblings = nullptr;
 
+		/* The values of a property, stored next to each other in the arena.  */
+		class value_list
+		{
+			std::string *m_first = nullptr;
+			size_t m_n = 0;
+		public:
+			value_list () = default;
+			value_list (std::string *first, size_t n) : m_first (first), m_n (n) { }
+			const std::string *begin () const { return m_first; }
+			const std::string *end () const { return m_first + m_n; }
+			size_t size () const { return m_n; }
+			bool empty () const { return m_n == 0; }
+		};
+
 		class property {
 		public:
 			std::string ident;
-			std::list<std::string> values;
+			value_list values;
+			sgf_prop id = sgf_prop::unknown;
 			/* True if we ever looked up this property, indicating that
 			   it is one the program understands.  */
 			bool handled = false;
+			property *m_next = nullptr;
+		};
 
-			property (std::string &i) : ident (i) { }
-			property (const property &other) = default;
-			property (property &&other) = default;
-			property &operator= (property &&other) = default;
-			property &operator= (const property &other) = default;
+		/* The properties of a node, in the order they appear in the file.  */
+		class property_list
+		{
+			property *m_first = nullptr;
+			property **m_end = &m_first;
+		public:
+			class iterator
+			{
+				property *m_p;
+			public:
+				iterator (property *p) : m_p (p) { }
+				property &operator* () const { return *m_p; }
+				property *operator-> () const { return m_p; }
+				iterator &operator++ () { m_p = m_p->m_next; return *this; }
+				bool operator!= (const iterator &other) const { return m_p != other.m_p; }
+			};
+			property_list () = default;
+			property_list (const property_list &) = delete;
+			property_list &operator= (const property_list &) = delete;
+			iterator begin () const { return iterator (m_first); }
+			iterator end () const { return iterator (nullptr); }
+			void append (property *p)
+			{
+				*m_end = p;
+				m_end = &p->m_next;
+			}
 		};
-		typedef std::vector<property> proplist;
-		proplist props;
 
+		/* A copy of a property that does not depend on the sgf it was read
+		   from.  Used to keep properties the program does not understand, so
+		   that they can be written out again.  */
+		struct stored_property
+		{
+			std::string ident;
+			std::vector<std::string> values;
+
+			explicit stored_property (const property &p)
+				: ident (p.ident), values (p.values.begin (), p.values.end ())
+			{
+			}
+		};
+		typedef std::vector<stored_property> proplist;
+
+		property_list props;
+		/* One bit per sgf_prop found in PROPS, so that looking for an absent
+		   property does not need to scan the list.  */
+		uint64_t m_present = 0;
+
+		/* Nodes are owned by the arena of their sgf, which destroys them
+		   all at once, so there is no need to free children here.  */
 		node ()
 		{
 			active = nullptr;
 			m_end_children = &m_children;
 		}
-		~node ()
-		{
-			while (m_children != nullptr) {
-				node *t = m_children;
-				m_children = t->m_siblings;
-				delete t;
-			}
-		}
+		node (const node &) = delete;
+		node &operator= (const node &) = delete;
 		void set_active (node *c)
 		{
 			active = c;
@@ -102,10 +232,21 @@ public:
 			if (! active)
 				active = c;
 		}
-		property *find_property (const char *id, bool require_value = true)
+		void add_property (property *p)
+		{
+			props.append (p);
+			m_present |= sgf_prop_bit (p->id);
+		}
+		bool has_any (uint64_t mask) const
+		{
+			return (m_present & mask) != 0;
+		}
+		property *find_property (sgf_prop id, bool require_value = true)
 		{
+			if (!has_any (sgf_prop_bit (id)))
+				return nullptr;
 			for (auto &i: props)
-				if (i.ident == id) {
+				if (i.id == id) {
 					if (require_value && i.values.empty ())
 						throw broken_sgf ();
 					i.handled = true;
@@ -113,29 +254,144 @@ public:
 				}
 			return nullptr;
 		}
-		const std::string *find_property_val (const char *id)
+		const std::string *find_property_val (sgf_prop id)
 		{
 			property *p = find_property (id);
 			if (p == nullptr)
 				return nullptr;
-			auto it = p->values.begin ();
-			const std::string *retval = &*it;
-			++it;
-			if (it != p->values.end ())
+			if (p->values.size () != 1)
 				throw broken_sgf ();
-			return retval;
+			return p->values.begin ();
 		}
 	};
 
-	node *nodes;
+private:
+	/* Everything in the tree comes from these, so that a tree is built with few
+	   allocations and freed in one go.  Strings that don't fit into std::string's
+	   inline buffer, mostly comments, still allocate their characters.  */
+	sgf_arena<node> m_nodes;
+	sgf_arena<node::property> m_props;
+	sgf_arena<std::string> m_values;
+
+public:
+	node *nodes = nullptr;
 	sgf_errors errs;
 
-	sgf (node *n, const sgf_errors &e) : nodes (n), errs (e)
+	sgf () = default;
+	sgf (const sgf &) = delete;
+	sgf &operator= (const sgf &) = delete;
+
+	node *create_node ()
 	{
+		return m_nodes.create ();
 	}
-	~sgf ()
+	/* Add a property IDENT to node N.  Its values are moved out of VALS.  */
+	node::property &add_property (node *n, const std::string &ident, std::vector<std::string> &vals)
+	{
+		node::property *p = m_props.create ();
+		p->ident = ident;
+		p->id = sgf_intern_prop (ident);
+		std::string *v = m_values.create_n (vals.size ());
+		for (size_t i = 0; i < vals.size (); i++)
+			v[i] = std::move (vals[i]);
+		p->values = node::value_list (v, vals.size ());
+		n->add_property (p);
+		return *p;
+	}
+};
+
+extern sgf *load_sgf (const char *data, size_t len);
+/* Like load_sgf, but builds only the first N_NODES nodes of the main line, which
+   by default is just the root node with the game information.  The rest of
+   the file is skipped without being interpreted.  */
+extern sgf *load_sgf_header (const char *data, size_t len, int n_nodes = 1);
+
+/* Where one game is found in a file holding a collection of them, i.e. a
+   sequence of game trees.  */
+struct sgf_game_span
+{
+	size_t offset;
+	size_t length;
+};
+/* Find the games of a collection with a lexical scan that builds no nodes.
+   A file with a single game yields a single span.  */
+extern std::vector<sgf_game_span> index_sgf_collection (const char *data, size_t len);
+
+/* The SGF writer produces its output through this interface.  Text is
+   collected in a buffer and passed on to write_out in large pieces, so that
+   big files never have to be held in memory as a whole.  */
+class sgf_writer
+{
+	static const size_t buf_size = 65536;
+	std::string m_buf;
+	size_t m_written = 0;
+	bool m_ok = true;
+
+	void maybe_flush ()
+	{
+		if (m_buf.size () >= buf_size)
+			flush ();
+	}
+
+protected:
+	virtual bool write_out (const char *, size_t) = 0;
+
+public:
+	sgf_writer ()
+	{
+		m_buf.reserve (buf_size);
+	}
+	virtual ~sgf_writer ()
+	{
+	}
+	sgf_writer &operator+= (char c)
+	{
+		m_buf += c;
+		maybe_flush ();
+		return *this;
+	}
+	sgf_writer &operator+= (const char *str)
+	{
+		m_buf += str;
+		maybe_flush ();
+		return *this;
+	}
+	sgf_writer &operator+= (const std::string &str)
+	{
+		m_buf += str;
+		maybe_flush ();
+		return *this;
+	}
+	/* Pass on everything that is buffered.  Returns false if any write
+	   failed so far.  */
+	bool flush ()
+	{
+		if (m_ok && !m_buf.empty ())
+			m_ok = write_out (m_buf.data (), m_buf.size ());
+		m_written += m_buf.size ();
+		m_buf.clear ();
+		return m_ok;
+	}
+	size_t bytes_written () const
+	{
+		return m_written + m_buf.size ();
+	}
+};
+
+class sgf_string_writer : public sgf_writer
+{
+	std::string &m_str;
+
+protected:
+	virtual bool write_out (const char *data, size_t len) override
+	{
+		m_str.append (data, len);
+		return true;
+	}
+
+public:
+	sgf_string_writer (std::string &s) : m_str (s)
 	{
-		delete nodes;
 	}
 };
 
@@ -147,25 +403,61 @@ public:
    that reason, and because it's a low-level part trying to be independent
    of Qt, load_sgf used to use plain istream.  However, that still doesn't
    work on Windows.
-   Qt got better with Qt5, so now we use the following adapter to make
-   a QFile appear somewhat like an istream.  */
+   Qt got better with Qt5, so now we use the following adapter to give the
+   parser the contents of a QIODevice as a single buffer.  Files are mapped
+   into memory where possible, other devices are read completely.  */
 
 #include <QDataStream>
 #include <QFile>
+#include <QByteArray>
 class IODeviceAdapter
 {
-	QIODevice &m_dev;
+	QFile *m_file = nullptr;
+	uchar *m_map = nullptr;
+	QByteArray m_buf;
+	const char *m_data;
+	size_t m_len;
 public:
-	IODeviceAdapter (QIODevice &d) : m_dev (d)
+	IODeviceAdapter (QIODevice &d);
+	~IODeviceAdapter ();
+	IODeviceAdapter (const IODeviceAdapter &) = delete;
+	IODeviceAdapter &operator= (const IODeviceAdapter &) = delete;
+
+	const char *data () const
 	{
+		return m_data;
 	}
-	bool get (char &c) const
+	size_t size () const
 	{
-		return m_dev.getChar (&c);
+		return m_len;
 	}
 };
 
 extern sgf *load_sgf (const IODeviceAdapter &);
+extern sgf *load_sgf_header (const IODeviceAdapter &, int n_nodes = 1);
+/* Like index_sgf_collection, for the contents of FILENAME.  The index is
+   cached on disk next to the file.  */
+extern std::vector<sgf_game_span> sgf_collection_index (const QString &filename, const IODeviceAdapter &);
+/* Load game number GAME from the collection in FILENAME, without parsing the
+   others.  If N_GAMES is given, it receives the number of games in the file.  */
+extern sgf *load_sgf_game (const QString &filename, const IODeviceAdapter &, size_t game,
+			   size_t *n_games = nullptr);
+
+class sgf_iodevice_writer : public sgf_writer
+{
+	QIODevice &m_dev;
+
+protected:
+	virtual bool write_out (const char *data, size_t len) override
+	{
+		return m_dev.write (data, len) == (qint64)len;
+	}
+
+public:
+	sgf_iodevice_writer (QIODevice &d) : m_dev (d)
+	{
+	}
+};
 #endif
 
 #endif
@@ -2,6 +2,7 @@
 #include <string>
 #include <sstream>
 #include <functional>
+#include <cstring>
 
 /* Ideally this code would be independent of Qt, but plain C++ seems to have little
    support for converting text encodings.  */
@@ -15,6 +16,95 @@
 #include "gogame.h"
 #include "gamedb.h"
 
+/* Most SGF text is plain ASCII, or UTF-8 in a file that says so.  In those
+   cases the bytes can be used as they are, and QTextCodec is only needed for
+   the rest.  */
+
+/* True for codecs that decode the bytes 0 to 127 as ASCII.  Identified by MIB
+   number, which needs no locking when files are loaded in several threads.  */
+static bool ascii_compatible_codec (const QTextCodec *codec)
+{
+	int mib = codec->mibEnum ();
+	return ((mib >= 3 && mib <= 13)		/* US-ASCII, ISO-8859-1 to 10 */
+		|| (mib >= 109 && mib <= 114)	/* ISO-8859-13 to 16, GBK, GB18030 */
+		|| mib == 106			/* UTF-8 */
+		|| mib == 18 || mib == 38	/* EUC-JP, EUC-KR */
+		|| mib == 2025 || mib == 2026	/* GB2312, Big5 */
+		|| mib == 2084 || mib == 2088	/* KOI8-R, KOI8-U */
+		|| (mib >= 2250 && mib <= 2259));	/* Windows-125x, TIS-620 */
+}
+
+/* Return the length of the ASCII prefix of the LEN bytes at P, testing eight
+   bytes at a time.  */
+static size_t ascii_prefix (const char *p, size_t len)
+{
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy (&w, p + i, 8);
+		if (w & 0x8080808080808080ull)
+			break;
+	}
+	while (i < len && (unsigned char)p[i] < 128)
+		i++;
+	return i;
+}
+
+/* True if the LEN bytes at P are UTF-8 which a UTF-8 codec would return
+   unchanged.  Anything unusual, such as a byte order mark or noncharacters,
+   is left to the codec.  */
+static bool utf8_passthrough (const char *p, size_t len)
+{
+	if (len >= 3 && memcmp (p, "\xEF\xBB\xBF", 3) == 0)
+		return false;
+	size_t i = 0;
+	for (;;) {
+		i += ascii_prefix (p + i, len - i);
+		if (i == len)
+			return true;
+		unsigned char c = p[i];
+		size_t n;
+		uint32_t cp, min;
+		if (c >= 0xC2 && c <= 0xDF)
+			n = 1, cp = c & 0x1F, min = 0x80;
+		else if ((c & 0xF0) == 0xE0)
+			n = 2, cp = c & 0x0F, min = 0x800;
+		else if (c >= 0xF0 && c <= 0xF4)
+			n = 3, cp = c & 0x07, min = 0x10000;
+		else
+			return false;
+		if (len - i <= n)
+			return false;
+		for (size_t k = 1; k <= n; k++) {
+			unsigned char cc = p[i + k];
+			if ((cc & 0xC0) != 0x80)
+				return false;
+			cp = (cp << 6) | (cc & 0x3F);
+		}
+		if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)
+		    || (cp >= 0xFDD0 && cp <= 0xFDEF) || (cp & 0xFFFE) == 0xFFFE)
+			return false;
+		i += n + 1;
+	}
+}
+
+/* Convert the LEN bytes at BYTES from CODEC to UTF-8 in OUT.  Return false if
+   there was a charset conversion error.  */
+static bool decode_text (const char *bytes, size_t len, const QTextCodec *codec, std::string &out)
+{
+	if ((ascii_prefix (bytes, len) == len && ascii_compatible_codec (codec))
+	    || (codec->mibEnum () == 106 && utf8_passthrough (bytes, len))) {
+		out.assign (bytes, len);
+		return true;
+	}
+	QTextCodec::ConverterState state;
+	QString tmp = codec->toUnicode (bytes, len, &state);
+	if (state.invalidChars > 0)
+		return false;
+	out = tmp.toStdString ();
+	return true;
+}
+
 static int coord_from_letter (char x)
 {
 	if (! isalpha (x))
@@ -63,40 +153,49 @@ static void put_stones (const sgf::node::property &p, int maxx, int maxy, std::f
 	}
 }
 
-static bool recognized_mark (const std::string &id)
-{
-	return id == "MA" || id == "TR" || id == "SQ" || id == "CR" || id == "LB" || id == "TW" || id == "TB";
-}
+static const uint64_t mark_props = (sgf_prop_bit (sgf_prop::MA) | sgf_prop_bit (sgf_prop::TR)
+				    | sgf_prop_bit (sgf_prop::SQ) | sgf_prop_bit (sgf_prop::CR)
+				    | sgf_prop_bit (sgf_prop::LB) | sgf_prop_bit (sgf_prop::TW)
+				    | sgf_prop_bit (sgf_prop::TB));
+
+static const uint64_t stone_props = (sgf_prop_bit (sgf_prop::B) | sgf_prop_bit (sgf_prop::W)
+				     | sgf_prop_bit (sgf_prop::AB) | sgf_prop_bit (sgf_prop::AW)
+				     | sgf_prop_bit (sgf_prop::AE));
 
 /* Look for mark properties in node N and add them to the go board.
    Return true iff we found territory markers.  */
 static bool add_marks (go_board &b, sgf::node *n)
 {
 	bool terr = false;
+	if (!n->has_any (mark_props))
+		return false;
 	for (auto &p: n->props) {
-		const std::string &id = p.ident;
-		if (recognized_mark (id)) {
+		sgf_prop id = p.id;
+		if (sgf_prop_bit (id) & mark_props) {
 			p.handled = true;
 			for (const auto &v: p.values) {
 				if (v.length () < 2)
 					continue;
 				int x1 = coord_from_letter (v[0]);
 				int y1 = coord_from_letter (v[1]);
-				mark mt = (id == "MA" ? mark::cross
-					   : id == "TR" ? mark::triangle
-					   : id == "SQ" ? mark::square
-					   : id == "CR" ? mark::circle
-					   : id == "TB" || id == "TW" ? mark::terr
+				/* Marks outside the board are harmless to drop.  */
+				if (x1 >= b.size_x () || y1 >= b.size_y ())
+					continue;
+				mark mt = (id == sgf_prop::MA ? mark::cross
+					   : id == sgf_prop::TR ? mark::triangle
+					   : id == sgf_prop::SQ ? mark::square
+					   : id == sgf_prop::CR ? mark::circle
+					   : id == sgf_prop::TB || id == sgf_prop::TW ? mark::terr
 					   : mark::text);
 				if (mt == mark::terr)
 					terr = true;
-				mextra extra = id == "TB" ? 1 : 0;
+				mextra extra = id == sgf_prop::TB ? 1 : 0;
 				if (mt == mark::text) {
 					if (v.length () < 4 || v[2] != ':')
 						continue;
 					std::string t = v.substr (3);
 					int num = -1;
-					if (!t.empty () && t.find_first_not_of ("0123456789") == std::string::npos)
+					if (!t.empty () && t.length () <= 3 && t.find_first_not_of ("0123456789") == std::string::npos)
 						num = stoi (t);
 					if (num >= 0 && num < 256 && std::to_string (num) == t) {
 						mt = mark::num;
@@ -123,7 +222,7 @@ static bool add_marks (go_board &b, sgf::node *n)
 /* Return true if OK, false if there was a charset conversion error.  */
 static bool add_comment (game_state *gs, sgf::node *n, QTextCodec *codec)
 {
-	sgf::node::property *comment = n->find_property ("C");
+	sgf::node::property *comment = n->find_property (sgf_prop::C);
 	if (comment) {
 		std::string cs;
 		for (const auto &c: comment->values) {
@@ -131,11 +230,8 @@ static bool add_comment (game_state *gs, sgf::node *n, QTextCodec *codec)
 		}
 		if (codec != nullptr) {
 			const char *bytes = cs.c_str ();
-			QTextCodec::ConverterState state;
-			QString tmp = codec->toUnicode (bytes, strlen (bytes), &state);
-			if (state.invalidChars > 0)
+			if (!decode_text (bytes, strlen (bytes), codec, cs))
 				return false;
-			cs = tmp.toStdString ();
 		}
 		gs->set_comment (cs);
 	}
@@ -143,9 +239,18 @@ static bool add_comment (game_state *gs, sgf::node *n, QTextCodec *codec)
 }
 
 /* Return true if OK, false if there was a charset conversion error.  */
+static int figure_flags (const std::string &v)
+{
+	try {
+		return stoi (v);
+	} catch (std::exception &) {
+		throw broken_sgf ();
+	}
+}
+
 static bool add_figure (game_state *gs, sgf::node *n, QTextCodec *codec)
 {
-	sgf::node::property *figure = n->find_property ("FG");
+	sgf::node::property *figure = n->find_property (sgf_prop::FG);
 	if (figure == nullptr)
 		return true;
 	if (figure->values.size () != 1)
@@ -162,21 +267,18 @@ static bool add_figure (game_state *gs, sgf::node *n, QTextCodec *codec)
 	int flags;
 	bool retval = true;
 	if (sep != std::string::npos) {
-		flags = stoi (v.substr (0, sep));
+		flags = figure_flags (v.substr (0, sep));
 		v = v.substr (sep + 1);
 		if (codec != nullptr) {
 			const char *bytes = v.c_str ();
-			QTextCodec::ConverterState state;
-			QString tmp = codec->toUnicode (bytes, strlen (bytes), &state);
-			if (state.invalidChars > 0) {
+			if (!decode_text (bytes, strlen (bytes), codec, v)) {
 				retval = false;
 				v = "";
-			} else
-				v = tmp.toStdString ();
+			}
 		}
 		gs->set_figure (flags, v);
 	} else {
-		flags = stoi (v);
+		flags = figure_flags (v);
 		gs->set_figure (flags, "");
 	}
 
@@ -185,7 +287,7 @@ static bool add_figure (game_state *gs, sgf::node *n, QTextCodec *codec)
 
 static void add_visible (game_state *gs, sgf::node *n)
 {
-	sgf::node::property *vw = n->find_property ("VW");
+	sgf::node::property *vw = n->find_property (sgf_prop::VW);
 	if (vw == nullptr)
 		return;
 	if (vw->values.size () == 1) {
@@ -258,11 +360,11 @@ static bool add_eval_1 (game_state *gs, sgf::node::property *propvals, bool kata
 
 static bool add_eval (game_state *gs, sgf::node *n)
 {
-	sgf::node::property *qlzv = n->find_property ("QLZV");
+	sgf::node::property *qlzv = n->find_property (sgf_prop::QLZV);
 	if (qlzv != nullptr)
 		if (!add_eval_1 (gs, qlzv, false))
 			return false;
-	sgf::node::property *qkgv = n->find_property ("QKGV");
+	sgf::node::property *qkgv = n->find_property (sgf_prop::QKGV);
 	if (qkgv != nullptr)
 		if (!add_eval_1 (gs, qkgv, true))
 			return false;
@@ -341,10 +443,10 @@ void db_info_from_sgf (go_board &b, sgf::node *n, bool is_root, sgf_errors &errs
 		bool is_pass = false;
 		sgf::node::proplist unrecognized;
 		for (auto &p : n->props) {
-			const std::string &id = p.ident;
-			if (id == "AB" || id == "B" || id == "AW" || id == "W" || id == "AE") {
+			sgf_prop id = p.id;
+			if (sgf_prop_bit (id) & stone_props) {
 				p.handled = true;
-				im thisprop_move = id.length () == 1 ? im::yes : im::no;
+				im thisprop_move = id == sgf_prop::B || id == sgf_prop::W ? im::yes : im::no;
 				if (is_move == im::unknown)
 					is_move = thisprop_move;
 				else if (is_move == im::yes || is_move != thisprop_move)
@@ -352,7 +454,8 @@ void db_info_from_sgf (go_board &b, sgf::node *n, bool is_root, sgf_errors &errs
 					   and all types must match.  */
 					throw broken_sgf ();
 
-				stone_color sc = id == "AB" || id == "B" ? black : id == "AW" || id == "W" ? white : none;
+				stone_color sc = (id == sgf_prop::AB || id == sgf_prop::B ? black
+						  : id == sgf_prop::AW || id == sgf_prop::W ? white : none);
 				if (is_move == im::yes)
 				{
 					if (p.values.size () != 1)
@@ -404,13 +507,20 @@ void db_info_from_sgf (go_board &b, sgf::node *n, bool is_root, sgf_errors &errs
 	}
 }
 
-static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCodec *codec, sgf_errors &errs)
+/* Convert the SGF nodes starting at N into children of GS.  If LAZY is true,
+   only the first variation is converted at every branch point; the others are
+   left for game_state::materialize_pending.  */
+static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCodec *codec, sgf_errors &errs,
+			       bool lazy)
 {
 	while (n) {
+		sgf::node *deferred = nullptr;
 		if (!force) {
-			while (n->m_siblings != nullptr)
+			if (lazy)
+				deferred = n->m_siblings;
+			else while (n->m_siblings != nullptr)
 			{
-				add_to_game_state (gs, n, true, codec, errs);
+				add_to_game_state (gs, n, true, codec, errs, lazy);
 				n = n->m_siblings;
 			}
 		}
@@ -422,8 +532,8 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 		bool is_pass = false;
 		sgf::node::proplist unrecognized;
 		for (auto &p : n->props) {
-			const std::string &id = p.ident;
-			if (id == "AB" || id == "B" || id == "AW" || id == "W" || id == "AE") {
+			sgf_prop id = p.id;
+			if (sgf_prop_bit (id) & stone_props) {
 #if 0
 				for (int i = 0; i < gs->move_number (); i++)
 					std::cerr << " ";
@@ -433,7 +543,7 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 				std::cerr << std::endl;
 #endif
 				p.handled = true;
-				im thisprop_move = id.length () == 1 ? im::yes : im::no;
+				im thisprop_move = id == sgf_prop::B || id == sgf_prop::W ? im::yes : im::no;
 				if (is_move == im::unknown)
 					is_move = thisprop_move;
 				else if (is_move == im::yes || is_move != thisprop_move)
@@ -441,7 +551,8 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 					   and all types must match.  */
 					throw broken_sgf ();
 
-				stone_color sc = id == "AB" || id == "B" ? black : id == "AW" || id == "W" ? white : none;
+				stone_color sc = (id == sgf_prop::AB || id == sgf_prop::B ? black
+						  : id == sgf_prop::AW || id == sgf_prop::W ? white : none);
 				if (is_move == im::yes)
 				{
 					if (p.values.size () != 1)
@@ -469,6 +580,10 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 						/* We'd like to throw, but Kogo's Joseki Dictionary has
 						   such errors.  */
 						errs.played_on_stone = true;
+						/* Deferred variations need a primary child in front of
+						   them, so convert them now.  */
+						for (; deferred != nullptr; deferred = deferred->m_siblings)
+							add_to_game_state (gs, deferred, true, codec, errs, lazy);
 						return;
 					}
 					new_board.add_stone (move_x, move_y, sc);
@@ -481,6 +596,7 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 		}
 		bool terr = add_marks (new_board, n);
 
+		game_state *parent = gs;
 		if (is_move == im::no || (is_move == im::unknown && terr)) {
 			/* @@@ fix up to_move.  */
 			new_board.identify_units ();
@@ -491,15 +607,17 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 			gs = gs->add_child_pass_nochecks (new_board, game_state::add_mode::keep_active);
 		} else
 			gs = gs->add_child_move_nochecks (new_board, to_move, move_x, move_y, game_state::add_mode::keep_active);
+		if (deferred != nullptr)
+			parent->set_pending (deferred);
 
-		const std::string *pm = n->find_property_val ("PM");
+		const std::string *pm = n->find_property_val (sgf_prop::PM);
 		if (pm) {
 			if (pm->length () != 1 || (*pm)[0] < '0' || (*pm)[0] > '2')
 				errs.invalid_val = true;
 			else
 				gs->set_print_numbering ((*pm)[0] - '0');
 		}
-		const std::string *mn = n->find_property_val ("MN");
+		const std::string *mn = n->find_property_val (sgf_prop::MN);
 		if (mn) {
 			try {
 				int nr = stoi (*mn);
@@ -508,10 +626,10 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 				errs.invalid_val = true;
 			}
 		}
-		const std::string *wl = n->find_property_val ("WL");
-		const std::string *bl = n->find_property_val ("BL");
-		const std::string *ow = n->find_property_val ("OW");
-		const std::string *ob = n->find_property_val ("OB");
+		const std::string *wl = n->find_property_val (sgf_prop::WL);
+		const std::string *bl = n->find_property_val (sgf_prop::BL);
+		const std::string *ow = n->find_property_val (sgf_prop::OW);
+		const std::string *ob = n->find_property_val (sgf_prop::OB);
 		if (wl)
 			gs->set_time_left (white, *wl);
 		if (bl)
@@ -526,7 +644,7 @@ static void add_to_game_state (game_state *gs, sgf::node *n, bool force, QTextCo
 		add_visible (gs, n);
 		for (const auto &p: n->props) {
 			if (!p.handled)
-				unrecognized.push_back (p);
+				unrecognized.emplace_back (p);
 		}
 		gs->set_unrecognized (unrecognized);
 		n = n->m_children;
@@ -546,41 +664,40 @@ std::string translated_prop_str (const std::string *val, const QTextCodec *codec
 		return *val;
 
 	const char *bytes = val->c_str ();
-	QTextCodec::ConverterState state;
-	QString tmp = codec->toUnicode (bytes, strlen (bytes), &state);
-	if (state.invalidChars > 0)
+	std::string result;
+	if (!decode_text (bytes, strlen (bytes), codec, result))
 		throw broken_sgf ();
-	return std::string (tmp.toStdString ());
+	return result;
 }
 
 game_info info_from_sgfroot (const sgf &s, QTextCodec *codec, sgf_errors &errs)
 {
-	const std::string *gn = s.nodes->find_property_val ("GN");
+	const std::string *gn = s.nodes->find_property_val (sgf_prop::GN);
 
-	const std::string *pw = s.nodes->find_property_val ("PW");
-	const std::string *wr = s.nodes->find_property_val ("WR");
-	const std::string *pb = s.nodes->find_property_val ("PB");
-	const std::string *br = s.nodes->find_property_val ("BR");
+	const std::string *pw = s.nodes->find_property_val (sgf_prop::PW);
+	const std::string *wr = s.nodes->find_property_val (sgf_prop::WR);
+	const std::string *pb = s.nodes->find_property_val (sgf_prop::PB);
+	const std::string *br = s.nodes->find_property_val (sgf_prop::BR);
 
-	const std::string *km = s.nodes->find_property_val ("KM");
-	const std::string *ru = s.nodes->find_property_val ("RU");
-	const std::string *ha = s.nodes->find_property_val ("HA");
-	const std::string *tm = s.nodes->find_property_val ("TM");
-	const std::string *ot = s.nodes->find_property_val ("OT");
-	const std::string *re = s.nodes->find_property_val ("RE");
+	const std::string *km = s.nodes->find_property_val (sgf_prop::KM);
+	const std::string *ru = s.nodes->find_property_val (sgf_prop::RU);
+	const std::string *ha = s.nodes->find_property_val (sgf_prop::HA);
+	const std::string *tm = s.nodes->find_property_val (sgf_prop::TM);
+	const std::string *ot = s.nodes->find_property_val (sgf_prop::OT);
+	const std::string *re = s.nodes->find_property_val (sgf_prop::RE);
 
-	const std::string *dt = s.nodes->find_property_val ("DT");
-	const std::string *pc = s.nodes->find_property_val ("PC");
-	const std::string *ev = s.nodes->find_property_val ("EV");
-	const std::string *ro = s.nodes->find_property_val ("RO");
+	const std::string *dt = s.nodes->find_property_val (sgf_prop::DT);
+	const std::string *pc = s.nodes->find_property_val (sgf_prop::PC);
+	const std::string *ev = s.nodes->find_property_val (sgf_prop::EV);
+	const std::string *ro = s.nodes->find_property_val (sgf_prop::RO);
 
-	const std::string *cp = s.nodes->find_property_val ("CP");
+	const std::string *cp = s.nodes->find_property_val (sgf_prop::CP);
 
-	const std::string *st = s.nodes->find_property_val ("ST");
+	const std::string *st = s.nodes->find_property_val (sgf_prop::ST);
 
 	/* Ignored, but ensure it doesn't go on the list of unrecognized properties to
 	   write out later.  */
-	s.nodes->find_property_val ("AP");
+	s.nodes->find_property_val (sgf_prop::AP);
 
 	if (km && km->length () == 0) {
 		errs.empty_komi = true;
@@ -627,7 +744,7 @@ game_info info_from_sgfroot (const sgf &s, QTextCodec *codec, sgf_errors &errs)
 
 std::pair<int, int> sizes_from_sgfroot (const sgf &s)
 {
-	const std::string *sz = s.nodes->find_property_val ("SZ");
+	const std::string *sz = s.nodes->find_property_val (sgf_prop::SZ);
 	int size_x = -1;
 	int size_y = 19;
 	/* GoGui writes files without SZ. Assume 19, I guess.  */
@@ -653,12 +770,84 @@ std::pair<int, int> sizes_from_sgfroot (const sgf &s)
 	return std::pair<int, int> { size_x, size_y };
 }
 
-std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
+/* What a record loaded by sgf2record_lazy needs to convert its remaining
+   variations later.  */
+struct sgf_lazy_source
+{
+	std::shared_ptr<sgf> tree;
+	QTextCodec *codec = nullptr;
+	/* Errors found while converting variations.  The record was shown to the user
+	   long ago, so the only one that matters is a variation we had to drop; that is
+	   reported when the record is saved.  */
+	sgf_errors errs;
+	bool dropped_variations = false;
+};
+
+void game_state::materialize_pending ()
+{
+	sgf::node *n = m_pending;
+	m_pending = nullptr;
+	sgf_lazy_source *src = m_manager->lazy_source ();
+	/* Only nodes created by sgf2record_lazy have pending variations, and their
+	   manager keeps the source.  If one turns up anywhere else, leave its
+	   variations alone rather than crash.  */
+	if (src == nullptr) {
+		m_pending = n;
+		return;
+	}
+	for (; n != nullptr; n = n->m_siblings) {
+		size_t n_before = m_children.size ();
+		try {
+			add_to_game_state (this, n, true, src->codec, src->errs, true);
+		} catch (broken_sgf &) {
+			/* A broken variation would have failed the whole load if we had seen it
+			   earlier.  Now the best we can do is to leave all of it out, rather
+			   than the part after the error, and remember that we did.  */
+			while (m_children.size () > n_before)
+				m_manager->release_game_state (m_children.back ());
+			src->errs.invalid_structure = true;
+			src->dropped_variations = true;
+		}
+	}
+}
+
+bool game_record::materialize_all ()
+{
+	sgf_lazy_source *src = lazy_source ();
+	if (src == nullptr)
+		return true;
+	m_root->walk_tree ([] (game_state *) { return true; });
+	return !src->dropped_variations;
+}
+
+/* Look for figures in the unconverted variations, so that the presence of
+   diagrams can be checked without converting everything.  */
+bool game_state::pending_has_figure () const
+{
+	if (m_pending == nullptr)
+		return false;
+	std::vector<const sgf::node *> stack { m_pending };
+	while (!stack.empty ()) {
+		const sgf::node *n = stack.back ();
+		stack.pop_back ();
+		for (; n != nullptr; n = n->m_children) {
+			if (n->has_any (sgf_prop_bit (sgf_prop::FG)))
+				return true;
+			if (n->m_siblings != nullptr)
+				stack.push_back (n->m_siblings);
+		}
+	}
+	return false;
+}
+
+/* If LAZY is nonnull, the conversion of variations is deferred, and the codec
+   to use for them is stored there.  */
+static go_game_ptr convert_sgf (const sgf &s, QTextCodec *codec, sgf_lazy_source *lazy)
 {
 	sgf_errors errs = s.errs;
 
-	const std::string *ff = s.nodes->find_property_val ("FF");
-	const std::string *gm = s.nodes->find_property_val ("GM");
+	const std::string *ff = s.nodes->find_property_val (sgf_prop::FF);
+	const std::string *gm = s.nodes->find_property_val (sgf_prop::GM);
 	bool our_extensions = false;
 	if (ff != nullptr) {
 		if (*ff == "1" || *ff == "2")
@@ -674,7 +863,7 @@ std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
 		}
 	}
 	if (codec == nullptr) {
-		const std::string *ca = s.nodes->find_property_val ("CA");
+		const std::string *ca = s.nodes->find_property_val (sgf_prop::CA);
 		if (ca != nullptr)
 			codec = QTextCodec::codecForName (ca->c_str ());
 		else
@@ -686,7 +875,7 @@ std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
 	std::tie (size_x, size_y) = sizes_from_sgfroot (s);
 
 	bool torus_h = false, torus_v = false;
-	const std::string *to = our_extensions ? s.nodes->find_property_val ("TO") : nullptr;
+	const std::string *to = our_extensions ? s.nodes->find_property_val (sgf_prop::TO) : nullptr;
 	if (to != nullptr) {
 		if (to->length () != 1 || !isdigit ((*to)[0]))
 			throw broken_sgf ();
@@ -698,7 +887,7 @@ std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
 
 	}
 
-	sgf::node::property *mask = s.nodes->find_property ("MASK");
+	sgf::node::property *mask = s.nodes->find_property (sgf_prop::MASK);
 
 	go_board initpos (size_x, size_y, torus_h, torus_v);
 	std::shared_ptr<bit_array> mask_array;
@@ -710,12 +899,12 @@ std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
 	if (mask_array != nullptr)
 		initpos.set_mask (mask_array);
 	for (auto &n: s.nodes->props)
-		if (n.ident == "AB") {
+		if (n.id == sgf_prop::AB) {
 			n.handled = true;
 			put_stones (n, size_x, size_y, [&] (int x, int y) { initpos.set_stone_nounits (x, y, black); });
 		}
 	for (auto &n: s.nodes->props)
-		if (n.ident == "AW") {
+		if (n.id == sgf_prop::AW) {
 			n.handled = true;
 			put_stones (n, size_x, size_y, [&] (int x, int y) { initpos.set_stone_nounits (x, y, white); });
 		}
@@ -724,39 +913,58 @@ std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
 
 	game_info info = info_from_sgfroot (s, codec, errs);
 
-	const std::string *pl = s.nodes->find_property_val ("PL");
+	const std::string *pl = s.nodes->find_property_val (sgf_prop::PL);
 	stone_color to_play = pl && *pl == "W" ? white : black;
 	std::shared_ptr<game_record> game = std::make_shared<game_record> (initpos, to_play, info, mask_array);
+	game_state *root = game->get_root ();
 
-	errs.charset_error |= !add_comment (game->m_root, s.nodes, codec);
-	errs.charset_error |= !add_figure (game->m_root, s.nodes, codec);
-	errs.malformed_eval |= !add_eval (game->m_root, s.nodes);
-	add_visible (game->m_root, s.nodes);
+	errs.charset_error |= !add_comment (root, s.nodes, codec);
+	errs.charset_error |= !add_figure (root, s.nodes, codec);
+	errs.malformed_eval |= !add_eval (root, s.nodes);
+	add_visible (root, s.nodes);
 
 	sgf::node::proplist unrecognized;
 	for (const auto &p: s.nodes->props) {
 		if (!p.handled)
-			unrecognized.push_back (p);
+			unrecognized.emplace_back (p);
 	}
-	game->m_root->set_unrecognized (unrecognized);
+	root->set_unrecognized (unrecognized);
 
-	add_to_game_state (game->m_root, s.nodes->m_children, false, codec, errs);
+	if (lazy != nullptr)
+		lazy->codec = codec;
+	add_to_game_state (root, s.nodes->m_children, false, codec, errs, lazy != nullptr);
 	game->set_errors (errs);
 	if (errs.any_set ())
 		game->set_modified ();
 
 	/* Fix up situations where we have a handicap game without a PL property.
-	   If it really looks like white to move, fix up the root node.  */
+	   If it really looks like white to move, fix up the root node.  The SGF
+	   is checked first so that deferred variations are not converted.  */
+	bool one_child = s.nodes->m_children != nullptr && s.nodes->m_children->m_siblings == nullptr;
 	if (pl == nullptr && info.handicap > 1
-	    && game->m_root->n_children () == 1
-	    && game->m_root->next_move ()->was_move_p ()
-	    && game->m_root->next_move ()->get_move_color () == white)
-		game->m_root->set_to_move (white);
+	    && one_child && root->n_children () == 1
+	    && root->next_move ()->was_move_p ()
+	    && root->next_move ()->get_move_color () == white)
+		root->set_to_move (white);
 
 	return game;
 }
 
-void go_board::append_mark_plane_sgf (std::string &s, const std::string &p, const bit_array &t) const
+std::shared_ptr<game_record> sgf2record (const sgf &s, QTextCodec *codec)
+{
+	return convert_sgf (s, codec, nullptr);
+}
+
+std::shared_ptr<game_record> sgf2record_lazy (const std::shared_ptr<sgf> &s, QTextCodec *codec)
+{
+	auto src = std::make_shared<sgf_lazy_source> ();
+	src->tree = s;
+	go_game_ptr game = convert_sgf (*s, codec, src.get ());
+	game->set_lazy_source (src);
+	return game;
+}
+
+void go_board::append_mark_plane_sgf (sgf_writer &s, const std::string &p, const bit_array &t) const
 {
 	if (t.popcnt () == 0)
 		return;
@@ -773,7 +981,7 @@ void go_board::append_mark_plane_sgf (std::string &s, const std::string &p, cons
 		}
 }
 
-void go_board::append_marks_sgf (std::string &s) const
+void go_board::append_marks_sgf (sgf_writer &s) const
 {
 	if (m_marks.size () == 0)
 		return;
@@ -816,7 +1024,7 @@ void go_board::append_marks_sgf (std::string &s) const
 		}
 }
 
-static void maybe_add_property (std::string &s, const go_board &b, const char *name, const bit_array &arr, int *linecount)
+static void maybe_add_property (sgf_writer &s, const go_board &b, const char *name, const bit_array &arr, int *linecount)
 {
 	if (arr.popcnt () == 0)
 		return;
@@ -835,7 +1043,7 @@ static void maybe_add_property (std::string &s, const go_board &b, const char *n
 		}
 }
 
-static void encode_string (std::string &s, const char *id, std::string src, bool force = false)
+static void encode_string (sgf_writer &s, const char *id, std::string src, bool force = false)
 {
 	if (force || src.length () > 0) {
 		if (id != nullptr) {
@@ -854,7 +1062,7 @@ static void encode_string (std::string &s, const char *id, std::string src, bool
 	}
 }
 
-static void write_array (const bit_array *bitmap, const char *name, std::string &s, const game_state *gs)
+static void write_array (const bit_array *bitmap, const char *name, sgf_writer &s, const game_state *gs)
 {
 	/* Note that the SGF standard is slightly defective here.  Points
 	   in VW properties are visible, while VW[] defines the whole
@@ -916,11 +1124,12 @@ static void write_array (const bit_array *bitmap, const char *name, std::string
 		}
 }
 
-void game_state::append_to_sgf (std::string &s, bool active_only) const
+void game_state::append_to_sgf (sgf_writer &s, bool active_only) const
 {
 	int linecount = 0;
 	const game_state *gs = this;
 	while (gs) {
+		gs->expand ();
 		const go_board &this_board = gs->m_board;
 		if (gs->m_parent == nullptr || gs->was_edit_p ()) {
 			go_board prev_board (this_board, none);
@@ -1004,18 +1213,19 @@ void game_state::append_to_sgf (std::string &s, bool active_only) const
 				have_scores = true;
 		for (const auto &it: gs->m_evals) {
 			if (it.visits > 0) {
+				const analyzer_id &id = gs->m_manager->analyzer (it.id);
 				if (first)
 					s += have_scores ? "QKGV" : "QLZV";
 				first = false;
 				s += "[" + std::to_string (it.visits) + ":" + std::to_string (it.wr_black);
 				if (have_scores)
 					s += (":" + QString::number (it.score_mean) + ":" + QString::number (it.score_stddev)).toStdString ();
-				if (it.id.komi_set) {
-					s += ":" + QString::number (it.id.komi).toStdString ();
-					if (it.id.engine.length () > 0)
-						s += ":" + it.id.engine;
-				} else if (it.id.engine.length () > 0)
-					s += "::" + it.id.engine;
+				if (id.komi_set) {
+					s += ":" + QString::number (id.komi).toStdString ();
+					if (id.engine.length () > 0)
+						s += ":" + id.engine;
+				} else if (id.engine.length () > 0)
+					s += "::" + id.engine;
 				s += "]";
 				linecount++;
 			}
@@ -1049,7 +1259,8 @@ void game_state::append_to_sgf (std::string &s, bool active_only) const
 	}
 }
 
-std::string game_record::to_sgf (bool active_only) const
+/* Write the game to S, and return false if an error occurred while writing.  */
+bool game_record::write_sgf (sgf_writer &s, bool active_only) const
 {
 	const go_board &rootb = m_root->get_board ();
 	std::string gm = "1";
@@ -1066,7 +1277,7 @@ std::string game_record::to_sgf (bool active_only) const
 	/* UTF-8 encoding should be guaranteed, since we convert other charsets
 	   when loading, and Qt uses Unicode internally and toStdString conversions
 	   guarantee UTF-8.  */
-	std::string s = "(;FF[4]GM[" + gm + "]CA[UTF-8]AP[" PACKAGE ":" VERSION "]";
+	s += "(;FF[4]GM[" + gm + "]CA[UTF-8]AP[" PACKAGE ":" VERSION "]";
 	std::string szx = std::to_string (rootb.size_x ());
 	std::string szy = std::to_string (rootb.size_y ());
 	encode_string (s, "SZ", szx == szy ? szx : szx + ":" + szy);
@@ -1080,7 +1291,13 @@ std::string game_record::to_sgf (bool active_only) const
 	encode_string (s, "PB", m_info.name_b);
 	encode_string (s, "WR", m_info.rank_w);
 	encode_string (s, "BR", m_info.rank_b);
-	encode_string (s, "KM", QString::number (m_info.komi).toStdString ());
+	/* KM is an SGF real, which has no exponent.  The default number format
+	   would use one for huge values, and the file could not be read back.  */
+	std::string komi = QString::number (m_info.komi, 'f', 6).toStdString ();
+	komi.erase (komi.find_last_not_of ('0') + 1);
+	if (komi.back () == '.')
+		komi.pop_back ();
+	encode_string (s, "KM", komi);
 	encode_string (s, "PC", m_info.place);
 	encode_string (s, "DT", m_info.date);
 	encode_string (s, "RU", m_info.rules);
@@ -1100,5 +1317,245 @@ std::string game_record::to_sgf (bool active_only) const
 
 	m_root->append_to_sgf (s, active_only);
 	s += ")\n";
+	return s.flush ();
+}
+
+std::string game_record::to_sgf (bool active_only) const
+{
+	std::string s;
+	sgf_string_writer w (s);
+	write_sgf (w, active_only);
+	return s;
+}
+
+#ifdef FUZZ_SGF
+/* A fuzz target and throughput benchmark for the SGF code, covering load_sgf,
+   sgf2record and writing the result out again.  Build with something like
+     g++ -DFUZZ_SGF -fPIC $(pkg-config --cflags --libs Qt5Core) \
+       sgf2board.cc sgfload.cc gogame.cc goboard.cc -o fuzz_sgf
+   Add -DFUZZ_SGF_LIBFUZZER -fsanitize=fuzzer,address (with clang) to get a
+   libFuzzer target instead of the plain driver.  Board masks are cached for
+   the lifetime of the program, so run with ASAN_OPTIONS=detect_leaks=0.
+   The plain driver is used as
+     fuzz_sgf [-runs N] DIR...   each corpus file, plus N mutations of it
+     fuzz_sgf -bench [MB]        throughput on a synthetic corpus
+   Broken input may be rejected with an exception, but must never crash or
+   hang, and whatever we accept must survive round trips through to_sgf.  */
+
+#include <chrono>
+#include <random>
+#include <cstdio>
+#include <QDir>
+#include <QFile>
+
+static void fuzz_one (const char *data, size_t len)
+{
+	/* These only scan, so they must cope with anything.  */
+	try {
+		index_sgf_collection (data, len);
+	} catch (std::exception &) {
+	}
+	try {
+		delete load_sgf_header (data, len, 5);
+	} catch (std::exception &) {
+	}
+
+	std::string out;
+	try {
+		std::shared_ptr<sgf> s (load_sgf (data, len));
+		go_game_ptr gr = sgf2record (*s, nullptr);
+		out = gr->to_sgf ();
+		if (sgf2record_lazy (s, nullptr)->to_sgf () != out) {
+			fprintf (stderr, "lazy conversion differs\n");
+			abort ();
+		}
+	} catch (std::exception &) {
+		return;
+	}
+	/* Our own output must load.  The first round trip may still normalize
+	   things (an edit node that changes nothing is written as an empty node,
+	   which reads back as a pass), but after that the output must be
+	   stable.  */
+	std::unique_ptr<sgf> s2 (load_sgf (out.data (), out.size ()));
+	std::string out2 = sgf2record (*s2, nullptr)->to_sgf ();
+	std::unique_ptr<sgf> s3 (load_sgf (out2.data (), out2.size ()));
+	if (sgf2record (*s3, nullptr)->to_sgf () != out2) {
+		fprintf (stderr, "round trip differs\n");
+		abort ();
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+	fuzz_one ((const char *)data, size);
+	return 0;
+}
+
+#ifndef FUZZ_SGF_LIBFUZZER
+
+/* The kinds of damage seen in files from servers: truncation, stray or
+   missing brackets and parentheses, and random bytes.  */
+static std::string mutate (const std::string &in, std::mt19937 &rng)
+{
+	std::string s = in;
+	static const char special[] = "()[];\\:";
+	int n = 1 + rng () % 4;
+	while (n-- > 0) {
+		size_t pos = s.empty () ? 0 : rng () % s.size ();
+		switch (rng () % 5) {
+		case 0:
+			s.resize (pos);
+			break;
+		case 1:
+			if (!s.empty ())
+				s.erase (pos, 1);
+			break;
+		case 2:
+			s.insert (pos, 1, special[rng () % (sizeof special - 1)]);
+			break;
+		case 3:
+			if (!s.empty ())
+				s[pos] = rng ();
+			break;
+		case 4:
+			s.insert (pos, s.substr (rng () % (s.size () + 1), rng () % 64));
+			break;
+		}
+	}
+	return s;
+}
+
+static int run_corpus (const QStringList &dirs, int runs)
+{
+	std::mt19937 rng (1);
+	int n_files = 0;
+	for (auto &d: dirs) {
+		QDir dir (d);
+		for (auto &f: dir.entryList (QDir::Files, QDir::Name)) {
+			QFile file (dir.filePath (f));
+			if (!file.open (QIODevice::ReadOnly))
+				continue;
+			QByteArray bytes = file.readAll ();
+			std::string data (bytes.constData (), bytes.size ());
+			fuzz_one (data.data (), data.size ());
+			for (int i = 0; i < runs; i++) {
+				std::string m = mutate (data, rng);
+				fuzz_one (m.data (), m.size ());
+			}
+			n_files++;
+		}
+	}
+	printf ("%d files, %d mutations each: no failures\n", n_files, runs);
+	return 0;
+}
+
+/* A synthetic game of about LEN bytes, with comments and variations.  Moves
+   only go to points that have not been played on in the game so far, and
+   passes are used once the board fills up.  */
+static std::string synthetic_game (std::mt19937 &rng, size_t len)
+{
+	std::string s = "(;GM[1]FF[4]SZ[19]PW[White]PB[Black]KM[6.5]";
+	std::vector<bool> used (19 * 19);
+	int n_used = 0;
+	int depth = 0;
+	bool black = true;
+	while (s.size () < len) {
+		s += black ? ";B[" : ";W[";
+		black = !black;
+		if (n_used < 300) {
+			int p;
+			do
+				p = rng () % (19 * 19);
+			while (used[p]);
+			used[p] = true;
+			n_used++;
+			s += (char)('a' + p % 19);
+			s += (char)('a' + p / 19);
+		}
+		s += ']';
+		if (rng () % 8 == 0)
+			s += "C[A comment about this move, with an escaped \\] bracket.]";
+		/* Open a variation, or end one and continue in a sibling.  */
+		if (rng () % 40 == 0 && depth < 8) {
+			s += "(";
+			depth++;
+		} else if (rng () % 30 == 0 && depth > 0)
+			s += ")(;B[tt]C[Alternative]";
+	}
+	while (depth-- > 0)
+		s += ")";
+	s += ")\n";
 	return s;
 }
+
+static size_t count_nodes (const sgf::node *n)
+{
+	size_t count = 0;
+	std::vector<const sgf::node *> stack { n };
+	while (!stack.empty ()) {
+		n = stack.back ();
+		stack.pop_back ();
+		for (; n != nullptr; n = n->m_children) {
+			count++;
+			if (n->m_siblings != nullptr)
+				stack.push_back (n->m_siblings);
+		}
+	}
+	return count;
+}
+
+static int run_bench (int mb)
+{
+	std::mt19937 rng (1);
+	std::vector<std::string> corpus;
+	size_t total = 0;
+	while (total < (size_t)mb << 20) {
+		corpus.push_back (synthetic_game (rng, 2000 + rng () % 4000));
+		total += corpus.back ().size ();
+	}
+
+	using clock = std::chrono::steady_clock;
+	double t_parse = 0, t_convert = 0, t_write = 0;
+	size_t nodes = 0;
+	for (auto &g: corpus) {
+		auto t0 = clock::now ();
+		std::shared_ptr<sgf> s (load_sgf (g.data (), g.size ()));
+		auto t1 = clock::now ();
+		go_game_ptr gr = sgf2record (*s, nullptr);
+		auto t2 = clock::now ();
+		std::string out = gr->to_sgf ();
+		auto t3 = clock::now ();
+		nodes += count_nodes (s->nodes);
+		t_parse += std::chrono::duration<double> (t1 - t0).count ();
+		t_convert += std::chrono::duration<double> (t2 - t1).count ();
+		t_write += std::chrono::duration<double> (t3 - t2).count ();
+	}
+	double mbytes = total / 1048576.;
+	printf ("%zu games, %.1f MB, %zu nodes\n", corpus.size (), mbytes, nodes);
+	printf ("load_sgf:   %8.1f MB/s %12.0f nodes/s\n", mbytes / t_parse, nodes / t_parse);
+	printf ("sgf2record: %8.1f MB/s %12.0f nodes/s\n", mbytes / t_convert, nodes / t_convert);
+	printf ("to_sgf:     %8.1f MB/s %12.0f nodes/s\n", mbytes / t_write, nodes / t_write);
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int runs = 100;
+	QStringList dirs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "-bench")
+			return run_bench (i + 1 < argc ? atoi (argv[i + 1]) : 64);
+		if (arg == "-runs" && i + 1 < argc)
+			runs = atoi (argv[++i]);
+		else
+			dirs << QString::fromLocal8Bit (argv[i]);
+	}
+	if (dirs.isEmpty ()) {
+		fprintf (stderr, "usage: %s [-runs N] DIR... | -bench [MB]\n", argv[0]);
+		return 1;
+	}
+	return run_corpus (dirs, runs);
+}
+#endif
+#endif
@@ -1,22 +1,171 @@
+#include <cstring>
+
 #include "goboard.h"
 #include "sgf.h"
 
-char skip_whitespace (const IODeviceAdapter &in)
+/* The lexer works on the complete file contents in one contiguous buffer, and
+   scans it with plain pointers.  */
+class sgf_lexer
 {
-    char nextch;
-    do {
-	if (! in.get (nextch))
+    const char *m_p;
+    const char *m_end;
+
+public:
+    sgf_lexer (const char *data, size_t len) : m_p (data), m_end (data + len)
+    {
+    }
+    char get ()
+    {
+	if (m_p == m_end)
+	    throw premature_eof ();
+	return *m_p++;
+    }
+    char skip_whitespace ()
+    {
+	char nextch;
+	do
+	    nextch = get ();
+	while (isspace ((unsigned char)nextch));
+	return nextch;
+    }
+    /* Like skip_whitespace, but returns 0 at the end of the data.  */
+    char skip_whitespace_or_eof ()
+    {
+	while (m_p != m_end && isspace ((unsigned char)*m_p))
+	    m_p++;
+	return m_p == m_end ? 0 : *m_p++;
+    }
+    const char *position () const
+    {
+	return m_p;
+    }
+    /* Called after the opening '['.  Collects everything up to the closing ']',
+       removing the backslashes used for escaping.  Values without escapes, which
+       are the vast majority, are copied in one go.  */
+    void read_value (std::string &valstr)
+    {
+	const char *start = m_p;
+	const char *p = start;
+	while (p != m_end && *p != ']' && *p != '\\')
+	    p++;
+	if (p == m_end)
 	    throw premature_eof ();
-    } while (isspace (nextch));
-    return nextch;
+	valstr.assign (start, p);
+	m_p = p;
+	if (*p == ']') {
+	    m_p++;
+	    return;
+	}
+	bool escaped = false;
+	for (;;) {
+	    char nextch = get ();
+	    if (! escaped && nextch == ']')
+		break;
+	    escaped = ! escaped && nextch == '\\';
+	    if (! escaped)
+		valstr += nextch;
+	}
+    }
+    /* Called after the opening '['.  Skips everything up to the closing ']'.  */
+    void skip_value ()
+    {
+	for (;;) {
+	    char nextch = get ();
+	    if (nextch == '\\')
+		get ();
+	    else if (nextch == ']')
+		return;
+	}
+    }
+    /* Skip the rest of a game tree without interpreting it, up to and including
+       the parenthesis that closes it.  NEXTCH is the character read last.  */
+    void skip_gametree (char nextch)
+    {
+	int depth = 0;
+	for (;;) {
+	    if (nextch == '[')
+		skip_value ();
+	    else if (nextch == '(')
+		depth++;
+	    else if (nextch == ')' && depth-- == 0)
+		return;
+	    nextch = get ();
+	}
+    }
+};
+
+/* Names of the sgf_prop values, in the same order.  */
+static const char *const prop_names[] = {
+    "",
+    "B", "W", "AB", "AW", "AE", "PL",
+    "C", "FG", "VW", "PM", "MN", "WL", "BL", "OW", "OB",
+    "MA", "TR", "SQ", "CR", "LB", "TW", "TB",
+    "GN", "PW", "WR", "PB", "BR", "KM", "RU", "HA", "TM", "OT", "RE", "DT", "PC", "EV", "RO", "CP", "ST", "AP",
+    "SZ", "FF", "GM", "CA",
+    "TO", "MASK", "QLZV", "QKGV"
+};
+
+static_assert (sizeof prop_names / sizeof *prop_names == (size_t)sgf_prop::n_props,
+	       "prop_names does not match sgf_prop");
+
+/* Identifiers consist only of uppercase letters (the parser drops everything
+   else), so the one and two letter ones, which are nearly all of them, can be
+   found in a small table.  */
+static const int short_prop_table_size = 26 * 27;
+
+static int short_prop_index (const std::string &ident)
+{
+    int idx = (ident[0] - 'A') * 27;
+    if (ident.length () == 2)
+	idx += ident[1] - 'A' + 1;
+    return idx;
 }
 
-sgf::node *parse_gametree (const IODeviceAdapter &in, sgf_errors &errs)
+struct short_prop_table
+{
+    sgf_prop entries[short_prop_table_size];
+    short_prop_table ()
+    {
+	for (auto &e: entries)
+	    e = sgf_prop::unknown;
+	for (int i = 1; i < (int)sgf_prop::n_props; i++) {
+	    std::string name = prop_names[i];
+	    if (name.length () <= 2)
+		entries[short_prop_index (name)] = (sgf_prop)i;
+	}
+    }
+};
+
+sgf_prop sgf_intern_prop (const std::string &ident)
 {
+    static const short_prop_table table;
+
+    size_t len = ident.length ();
+    if (len == 0)
+	return sgf_prop::unknown;
+    if (len <= 2) {
+	if (ident[0] < 'A' || ident[0] > 'Z' || (len == 2 && (ident[1] < 'A' || ident[1] > 'Z')))
+	    return sgf_prop::unknown;
+	return table.entries[short_prop_index (ident)];
+    }
+    for (int i = (int)sgf_prop::MASK; i < (int)sgf_prop::n_props; i++)
+	if (ident == prop_names[i])
+	    return (sgf_prop)i;
+    return sgf_prop::unknown;
+}
+
+/* Parse a game tree, after its opening parenthesis.  NODES_LEFT limits the
+   number of nodes that are created if it is nonnegative; in that case only
+   the main line is built and everything else is skipped.  */
+static sgf::node *parse_gametree (sgf_lexer &in, sgf &s, int &nodes_left)
+{
+    sgf_errors &errs = s.errs;
     sgf::node *prev_node = 0, *first_node = 0;
+    /* Values are collected here, then moved into the arena in one piece.  */
+    std::vector<std::string> vals;
 
     bool at_start = true;
-    char nextch = skip_whitespace (in);
+    char nextch = in.skip_whitespace ();
     for (;;) {
 	if (nextch != ';' && (nextch == ')' || !at_start))
 	    break;
@@ -24,53 +173,49 @@ sgf::node *parse_gametree (const IODeviceAdapter &in, sgf_errors &errs)
 	    errs.invalid_structure = true;
 	at_start = false;
 
-	sgf::node *this_node = new sgf::node ();
+	if (nodes_left == 0) {
+	    in.skip_gametree (nextch);
+	    return first_node;
+	}
+	if (nodes_left > 0)
+	    nodes_left--;
+
+	sgf::node *this_node = s.create_node ();
 	if (prev_node)
 	    prev_node->add_child (this_node);
 	else
 	    first_node = this_node;
 	prev_node = this_node;
 
-	if (nextch == ';' || isspace (nextch))
-	    nextch = skip_whitespace (in);
+	if (nextch == ';' || isspace ((unsigned char)nextch))
+	    nextch = in.skip_whitespace ();
 	for (;;) {
 	    std::string idstr = "";
-	    while (isalpha (nextch) && isalpha (nextch)) {
+	    while (isalpha ((unsigned char)nextch)) {
 		/* When downloading from their web interface, IGS writes
 		   properties with two uppercase and several ignored lowercase
 		   letters.  Ideally we'd add warning flags to the SGF to
 		   inform the user they have a broken file.  But for now,
 		   silently ignore them.  */
-		if (isupper (nextch))
+		if (isupper ((unsigned char)nextch))
 		    idstr += nextch;
-		if (! in.get (nextch))
-		    throw premature_eof ();
+		nextch = in.get ();
 	    }
 	    if (idstr.length () == 0)
 		break;
 
-	    if (isspace (nextch))
-		nextch = skip_whitespace (in);
+	    if (isspace ((unsigned char)nextch))
+		nextch = in.skip_whitespace ();
 	    if (nextch != '[')
 	      throw broken_sgf ();
 
-	    this_node->props.emplace_back (idstr);
-	    auto &p = this_node->props.back ();
+	    vals.clear ();
 	    while (nextch == '[') {
-		std::string valstr = "";
-		int escaped = 0;
-		for (;;) {
-		    if (! in.get (nextch))
-			throw premature_eof ();
-		    if (! escaped && nextch == ']')
-			break;
-		    escaped = ! escaped && nextch == '\\';
-		    if (! escaped)
-			valstr += nextch;
-		}
-		p.values.push_back (valstr);
-		nextch = skip_whitespace (in);
+		vals.emplace_back ();
+		in.read_value (vals.back ());
+		nextch = in.skip_whitespace ();
 	    }
+	    s.add_property (this_node, idstr, vals);
 	}
     }
 
@@ -84,40 +229,201 @@ sgf::node *parse_gametree (const IODeviceAdapter &in, sgf_errors &errs)
 	if (! prev_node)
 	    throw broken_sgf ();
 
-	sgf::node *n = parse_gametree (in, errs);
-	prev_node->add_child (n);
-	nextch = skip_whitespace (in);
+	if (nodes_left >= 0 && (nodes_left == 0 || prev_node->m_children != nullptr)) {
+	    in.skip_gametree (nextch);
+	    break;
+	}
+	sgf::node *n = parse_gametree (in, s, nodes_left);
+	/* An empty variation, "()".  */
+	if (n == nullptr)
+	    errs.invalid_structure = true;
+	else
+	    prev_node->add_child (n);
+	nextch = in.skip_whitespace ();
     }
 
     return first_node;
 }
 
-sgf *load_sgf (const IODeviceAdapter &in)
+static sgf *load_sgf_1 (const char *data, size_t len, int max_nodes)
 {
-    char nextch;
+    sgf_lexer in (data, len);
+    char nextch = in.get ();
 
-    if (!in.get (nextch))
-	throw premature_eof ();
     /* Look for (and discard) a UTF-8 BOM.  Bogus, since SGF is a
        binary file format, but it occurs in the wild.  */
     if (nextch == (char)0xEF) {
-	if (!in.get (nextch))
-	    throw premature_eof ();
-	if (nextch != (char)0xBB)
+	if (in.get () != (char)0xBB)
 	    throw broken_sgf ();
-	if (!in.get (nextch))
-	    throw premature_eof ();
-	if (nextch != (char)0xBF)
+	if (in.get () != (char)0xBF)
 	    throw broken_sgf ();
-	if (!in.get (nextch))
-	    throw premature_eof ();
+	nextch = in.get ();
     }
-    if (isspace (nextch))
-	nextch = skip_whitespace (in);
+    if (isspace ((unsigned char)nextch))
+	nextch = in.skip_whitespace ();
     if (nextch != '(')
 	throw broken_sgf ();
-    sgf_errors errs;
-    sgf::node *nodes = parse_gametree (in, errs);
-    sgf *s = new sgf (nodes, errs);
-    return s;
+    /* All nodes are freed with the sgf if an exception occurs.  */
+    std::unique_ptr<sgf> s (new sgf);
+    s->nodes = parse_gametree (in, *s, max_nodes);
+    /* An empty game tree, "()".  */
+    if (s->nodes == nullptr)
+	throw broken_sgf ();
+    return s.release ();
+}
+
+sgf *load_sgf (const char *data, size_t len)
+{
+    return load_sgf_1 (data, len, -1);
+}
+
+sgf *load_sgf_header (const char *data, size_t len, int n_nodes)
+{
+    return load_sgf_1 (data, len, n_nodes);
+}
+
+std::vector<sgf_game_span> index_sgf_collection (const char *data, size_t len)
+{
+    std::vector<sgf_game_span> spans;
+    size_t start = 0;
+    if (len >= 3 && memcmp (data, "\xEF\xBB\xBF", 3) == 0)
+	start = 3;
+    sgf_lexer in (data + start, len - start);
+    for (;;) {
+	/* Like load_sgf, ignore anything after the last game.  */
+	char nextch = in.skip_whitespace_or_eof ();
+	if (nextch != '(') {
+	    if (spans.empty ())
+		throw broken_sgf ();
+	    break;
+	}
+	const char *game_start = in.position () - 1;
+	try {
+	    in.skip_gametree (in.get ());
+	} catch (premature_eof &) {
+	    /* A truncated game at the end of a collection is dropped.  */
+	    if (spans.empty ())
+		throw;
+	    break;
+	}
+	spans.push_back ({ (size_t)(game_start - data), (size_t)(in.position () - game_start) });
+    }
+    return spans;
+}
+
+#ifndef TEST
+#include <QFileInfo>
+#include <QDateTime>
+
+IODeviceAdapter::IODeviceAdapter (QIODevice &d)
+{
+    QFile *f = qobject_cast<QFile *> (&d);
+    if (f != nullptr && !f->isSequential ()) {
+	qint64 pos = f->pos ();
+	qint64 len = f->size () - pos;
+	if (len > 0)
+	    m_map = f->map (pos, len);
+	if (m_map != nullptr) {
+	    m_file = f;
+	    m_data = (const char *)m_map;
+	    m_len = len;
+	    return;
+	}
+    }
+    m_buf = d.readAll ();
+    m_data = m_buf.constData ();
+    m_len = m_buf.size ();
+}
+
+IODeviceAdapter::~IODeviceAdapter ()
+{
+    if (m_map != nullptr)
+	m_file->unmap (m_map);
+}
+
+sgf *load_sgf (const IODeviceAdapter &in)
+{
+    return load_sgf (in.data (), in.size ());
+}
+
+sgf *load_sgf_header (const IODeviceAdapter &in, int n_nodes)
+{
+    return load_sgf_header (in.data (), in.size (), n_nodes);
+}
+
+/* The index of a collection is kept in a small file next to it, named by
+   appending ".q5i".  It is valid only while the size and modification time
+   of the SGF file match the ones recorded in it.  */
+static const int collection_cache_version = 1;
+static const qint64 collection_cache_header = 28;
+
+static bool read_collection_cache (QFile &cache, quint64 size, qint64 mtime, std::vector<sgf_game_span> &spans)
+{
+    QDataStream ds (&cache);
+    char magic[4];
+    if (ds.readRawData (magic, 4) != 4 || memcmp (magic, "q5gi", 4) != 0)
+	return false;
+    quint32 version, count;
+    quint64 c_size;
+    qint64 c_mtime;
+    ds >> version >> c_size >> c_mtime >> count;
+    if (ds.status () != QDataStream::Ok || version != collection_cache_version
+	|| c_size != size || c_mtime != mtime
+	|| count == 0 || count > (cache.size () - collection_cache_header) / 16)
+	return false;
+    spans.reserve (count);
+    for (quint32 i = 0; i < count; i++) {
+	quint64 off, len;
+	ds >> off >> len;
+	if (ds.status () != QDataStream::Ok || off > size || len > size - off)
+	    return false;
+	spans.push_back ({ (size_t)off, (size_t)len });
+    }
+    return true;
+}
+
+std::vector<sgf_game_span> sgf_collection_index (const QString &filename, const IODeviceAdapter &in)
+{
+    QFileInfo fi (filename);
+    qint64 mtime = fi.lastModified ().toMSecsSinceEpoch ();
+    QFile cache (filename + ".q5i");
+    if (cache.open (QIODevice::ReadOnly)) {
+	std::vector<sgf_game_span> spans;
+	bool ok = read_collection_cache (cache, in.size (), mtime, spans);
+	cache.close ();
+	if (ok)
+	    return spans;
+    }
+
+    std::vector<sgf_game_span> spans = index_sgf_collection (in.data (), in.size ());
+    /* Not worth a file for the common case of a single game.  */
+    if (spans.size () > 1 && cache.open (QIODevice::WriteOnly | QIODevice::Truncate)) {
+	QDataStream ds (&cache);
+	ds.writeRawData ("q5gi", 4);
+	ds << (quint32)collection_cache_version << (quint64)in.size () << mtime << (quint32)spans.size ();
+	for (auto &s: spans)
+	    ds << (quint64)s.offset << (quint64)s.length;
+	bool ok = ds.status () == QDataStream::Ok && cache.flush ();
+	cache.close ();
+	if (!ok)
+	    cache.remove ();
+    }
+    return spans;
+}
+
+sgf *load_sgf_game (const QString &filename, const IODeviceAdapter &in, size_t game,
+		    size_t *n_games)
+{
+    /* The first game does not need the index; load_sgf stops after it.  */
+    if (game == 0 && n_games == nullptr)
+	return load_sgf (in);
+    std::vector<sgf_game_span> spans = sgf_collection_index (filename, in);
+    if (n_games != nullptr)
+	*n_games = spans.size ();
+    if (game == 0)
+	return load_sgf (in);
+    if (game >= spans.size ())
+	throw broken_sgf ();
+    return load_sgf (in.data () + spans[game].offset, spans[game].length);
 }
+#endif
@@ -3,6 +3,7 @@
 
 #include "gogame.h"
 #include "sgfpreview.h"
+#include "ui_helpers.h"
 #include "ui_sgfpreview.h"
 
 SGFPreview::SGFPreview (QWidget *parent, const QString &dir)
@@ -64,6 +65,16 @@ QStringList SGFPreview::selected ()
 	return fileDialog->selectedFiles ();
 }
 
+QTextCodec *SGFPreview::selected_codec ()
+{
+	if (ui->overwriteSGFEncoding->isChecked ())
+		return QTextCodec::codecForName (ui->encodingList->currentText ().toLatin1 ());
+	return nullptr;
+}
+
+/* Only the start of the main line is read to show the preview, which keeps
+   browsing through large directories fast.  The complete game is loaded once
+   the user has made a choice, in selected_record.  */
 void SGFPreview::setPath(QString path)
 {
 	clear ();
@@ -71,18 +82,15 @@ void SGFPreview::setPath(QString path)
 	try {
 		QFile f (path);
 		f.open (QIODevice::ReadOnly);
-		// IOStreamAdapter adapter (&f);
-		sgf *sgf = load_sgf (f);
-		if (ui->overwriteSGFEncoding->isChecked ()) {
-			m_game = sgf2record (*sgf, QTextCodec::codecForName (ui->encodingList->currentText ().toLatin1 ()));
-		} else {
-			m_game = sgf2record (*sgf, nullptr);
-		}
+		IODeviceAdapter adapter (f);
+		std::unique_ptr<sgf> sgf (load_sgf_header (adapter, preview_moves + 1));
+		m_game = sgf2record (*sgf, selected_codec ());
 		m_game->set_filename (path.toStdString ());
+		m_path = path;
 
 		ui->boardView->reset_game (m_game);
 		game_state *st = m_game->get_root ();
-		for (int i = 0; i < 20 && st->n_children () > 0; i++)
+		for (int i = 0; i < preview_moves && st->n_children () > 0; i++)
 			st = st->next_primary_move ();
 		ui->boardView->set_displayed (st);
 
@@ -100,6 +108,15 @@ void SGFPreview::setPath(QString path)
 	}
 }
 
+/* Load the complete game whose preview is shown.  Errors are reported to
+   the user with message boxes, and a null pointer is returned.  */
+go_game_ptr SGFPreview::selected_record ()
+{
+	if (m_game == nullptr)
+		return nullptr;
+	return record_from_file (m_path, selected_codec ());
+}
+
 void SGFPreview::reloadPreview ()
 {
 	auto files = fileDialog->selectedFiles ();
@@ -19,8 +19,13 @@ class SGFPreview : public QDialog
 
 	QFileDialog *fileDialog;
 	go_game_ptr m_empty_game;
+	/* Only the first few moves of the selected file.  */
 	go_game_ptr m_game;
+	QString m_path;
 
+	static const int preview_moves = 20;
+
+	QTextCodec *selected_codec ();
 	void setPath (QString path);
 	void reloadPreview ();
 	void clear ();
@@ -31,7 +36,8 @@ public:
 	virtual void accept () override;
 	QStringList selected ();
 
-	go_game_ptr selected_record () { return m_game; }
+	bool has_preview () const { return m_game != nullptr; }
+	go_game_ptr selected_record ();
 };
 
 #endif
@@ -2,6 +2,7 @@
 #define UI_HELPERS_H
 
 #include <utility>
+#include <functional>
 
 extern QString screen_key (QWidget *);
 
@@ -13,7 +14,10 @@ extern QString open_filename_dialog (QWidget *);
 extern go_game_ptr new_game_dialog (QWidget *);
 extern go_game_ptr new_variant_game_dialog (QWidget *);
 extern go_game_ptr record_from_stream (QIODevice &isgf, QTextCodec *codec);
-extern go_game_ptr record_from_file (const QString &filename, QTextCodec *codec);
+extern go_game_ptr record_from_file (const QString &filename, QTextCodec *codec, size_t game = 0);
+extern bool records_from_files (QWidget *parent, const QStringList &files, QTextCodec *codec,
+				const std::function<void (const QString &, go_game_ptr)> &callback,
+				const std::function<QString (const sgf &)> &reject = nullptr);
 extern bool open_window_from_file (const QString &filename);
 extern bool open_local_board (QWidget *, game_dialog_type, const QString &);
 extern QString get_candidate_filename (const QString &dir, const game_info &);